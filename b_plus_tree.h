@@ -1,60 +1,45 @@
 #ifndef B_PLUS_TREE_H
 #define B_PLUS_TREE_H
 
+#include <algorithm>
+#include <chrono>
+#include <concepts>
+#include <condition_variable>
 #include <fstream>
+#include <iterator>
+#include <mutex>
+#include <shared_mutex>
+#include <span>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include "bloom_filter.h"
 #include "file_processor.h"
+#include "index_key.h"
+#include "leaf_codec.h"
+#include "memtable.h"
+#include "node_search.h"
+#include "page_versions.h"
+#include "readahead.h"
 #include "vector.hpp"
+#include "write_ahead_log.h"
 
 namespace sjtu {
-  template <typename Value>
+  // PageBytes is the size of one node on disk, the data file records it and refuses any other.
+  // Storage is file_processor (stream with a page cache) or mmap_file_processor (shared mapping).
+  // Keys turns an index string into its key: hashed_index (a 128-bit hash) or string_index<Bytes> (the string
+  // itself, which keeps the tree in string order for PrefixScan and LowerBound). The map file records its format.
+  // A tree may be used by several threads at once. Reads, and updates that fit in their leaf, only latch that
+  // leaf and run side by side; splits, merges, batches and checkpoints have the tree to themselves.
+  // Snapshot() keeps a read-only view of the tree as it is, for scans that should not hold up the writers.
+  template <typename Value, long PageBytes = FILE_UNIT_SIZE,
+            template <typename, long> class Storage = file_processor, typename Keys = hashed_index>
   class bpt {
-    const unsigned long long P = 131;
-    const unsigned long long Q = 107;
-    const unsigned long long M = 1e9 + 7;
-
-    struct hash_pair {
-      unsigned long long hash1 = 0;
-      unsigned long long hash2 = 0;
-      bool operator==(const hash_pair &other) const {
-        if (hash1 == other.hash1 && hash2 == other.hash2) {
-          return true;
-        }
-        return false;
-      }
-      bool operator>(const hash_pair &other) const {
-        if (hash1 != other.hash1) {
-          return hash1 > other.hash1;
-        }
-        return hash2 > other.hash2;
-      }
-      bool operator<(const hash_pair &other) const {
-        if (hash1 != other.hash1) {
-          return hash1 < other.hash1;
-        }
-        return hash2 < other.hash2;
-      }
-      bool operator!=(const hash_pair &other) const {
-        return !(*this == other);
-      }
-      bool operator<=(const hash_pair &other) const {
-        return !(*this > other);
-      }
-      bool operator>=(const hash_pair &other) const {
-        return !(*this < other);
-      }
-    };
-    hash_pair db_hash(const std::string &str) {
-      unsigned long long hash1 = 0;
-      unsigned long long hash2 = 0;
-      for (int i = 0; i < str.length(); ++i) {
-        hash1 = (hash1 * P + str[i]) % M;
-        hash2 = (hash2 * Q + str[i]) % M;
-      }
-      return {hash1, hash2};
-    }
+    using key_type = index_key<Keys::WORDS>;
+    static constexpr int TAIL_WORDS = Keys::WORDS - 1;
 
     struct index_value {
-      hash_pair index;
+      key_type index;
       Value value;
 
       bool operator==(const index_value &other) const {
@@ -80,38 +65,217 @@ namespace sjtu {
     struct map_info {
       long root = -1, head = -1;
       long long size = 0ll;
+      long long lsn = 0ll; // last logged update that the tree already contains
+      bool compressed = false; // leaves are stored with leaf_codec, decided while the tree is empty
+      long key_format = 0; // Keys::Format() the tree was built with, 0 in map files written before it was recorded
+      long long filter_generation = 0; // the filter file that was saved together with this information
+      bool buffered = false; // inner blocks buffer the updates for their sons, decided while the tree is empty
+      long long messages = 0; // updates waiting in those buffers
     };
 
-    static constexpr long PAGE_SIZE = (FILE_UNIT_SIZE - sizeof(int) * 2 - sizeof(long)) / (sizeof(index_value) + sizeof(int));
+    static constexpr int LEAF_PAGE = 1, INNER_PAGE = 2; // the type in front of every page of the tree
+
+    // type, block_size, next_block and bytes take sizeof(int) * 4 + sizeof(long), the padding at the end sizeof(long)
+    static constexpr long LEAF_SIZE = (PageBytes - sizeof(int) * 4 - sizeof(long) * 2) / (sizeof(key_type) + sizeof(Value));
+    // type, block_size, the extra son_pos and the padding at the end take sizeof(int) * 2 + sizeof(long) * 2
+    static constexpr long INNER_CAPACITY = (PageBytes - sizeof(int) * 2 - sizeof(long) * 2) /
+                                           (sizeof(key_type) + sizeof(Value) + sizeof(int));
+    // kept odd: merging two inner blocks below INNER_SIZE / 2 must leave fewer than INNER_SIZE elements
+    static constexpr long INNER_SIZE = INNER_CAPACITY % 2 == 1 ? INNER_CAPACITY : INNER_CAPACITY - 1;
+    // A buffered tree gives its inner blocks at most BUFFERED_FANOUT sons and keeps a buffer of messages in the
+    // slots above: message j is the element at slot BUFFERED_FANOUT + j, son_pos[BUFFERED_FANOUT] counts them
+    // and son_pos[BUFFERED_FANOUT + 1 + j] tells an insert (1) from a delete (0).
+    static constexpr long BUFFERED_FANOUT = INNER_SIZE / 16 * 2 + 1 < 3 ? 3 : INNER_SIZE / 16 * 2 + 1;
+    static constexpr long BUFFER_SIZE = INNER_SIZE - BUFFERED_FANOUT;
+
+    // Searches shared by both kinds of block. The elements are stored as one array per field, so the first
+    // key words of a block lie next to each other and CountBelow compares several of them at once.
+    template <typename Node>
+    struct sorted_keys {
+      const Node &Self() const {
+        return static_cast<const Node &>(*this);
+      }
+
+      index_value Key(const int i) const {
+        return {Index(i), Self().value[i]};
+      }
+
+      key_type Index(const int i) const {
+        key_type index;
+        index.word[0] = Self().lead[i];
+        std::copy(Self().tail[i], Self().tail[i] + TAIL_WORDS, index.word + 1);
+        return index;
+      }
+
+      void SetKey(const int i, const index_value &key) {
+        Node &node = static_cast<Node &>(*this);
+        node.lead[i] = key.index.word[0];
+        std::copy(key.index.word + 1, key.index.word + 1 + TAIL_WORDS, node.tail[i]);
+        node.value[i] = key.value;
+      }
+
+      // first element whose index is not below index, or above it if Inclusive
+      template <bool Inclusive = false>
+      int Rank(const key_type &index) const {
+        const Node &node = Self();
+        int l = CountBelow(node.lead, node.block_size, index.word[0]);
+        int r = l + CountBelow<true>(node.lead + l, node.block_size - l, index.word[0]);
+        while (l < r) {
+          const int m = (l + r) >> 1;
+          if (Inclusive ? Index(m) <= index : Index(m) < index) {
+            l = m + 1;
+          } else {
+            r = m;
+          }
+        }
+        return l;
+      }
 
-    struct block {
-      int block_size;
-      long next_block;
-      index_value r_min[PAGE_SIZE];
-      int son_pos[PAGE_SIZE + 1]{};
+      // first element that is not below key
+      int LowerBound(const index_value &key) const {
+        const Node &node = Self();
+        int l = CountBelow(node.lead, node.block_size, key.index.word[0]);
+        int r = l + CountBelow<true>(node.lead + l, node.block_size - l, key.index.word[0]);
+        while (l < r) {
+          const int m = (l + r) >> 1;
+          if (Key(m) < key) {
+            l = m + 1;
+          } else {
+            r = m;
+          }
+        }
+        return l;
+      }
 
-      block() {
-        block_size = 0;
-        next_block = -1;
-        for (int i = 0; i <= PAGE_SIZE; ++i) {
-          son_pos[i] = -1;
+      // first element above key, which is the son to follow for key in an inner block
+      int UpperBound(const index_value &key) const {
+        const Node &node = Self();
+        int l = CountBelow(node.lead, node.block_size, key.index.word[0]);
+        int r = l + CountBelow<true>(node.lead + l, node.block_size - l, key.index.word[0]);
+        while (l < r) {
+          const int m = (l + r) >> 1;
+          if (Key(m) <= key) {
+            l = m + 1;
+          } else {
+            r = m;
+          }
         }
+        return l;
       }
     };
 
+    struct leaf_block : sorted_keys<leaf_block> {
+      int type = LEAF_PAGE;
+      int block_size = 0;
+      long next_block = -1;
+      int bytes = 0; // length of the encoded entries of a compressed leaf
+      unsigned long long lead[LEAF_SIZE];
+      unsigned long long tail[LEAF_SIZE][TAIL_WORDS];
+      Value value[LEAF_SIZE];
+    };
+
+    // the separators keep their value too, since the elements of one index can spread over many sons
+    struct inner_block : sorted_keys<inner_block> {
+      int type = INNER_PAGE;
+      int block_size = 0;
+      unsigned long long lead[INNER_SIZE];
+      unsigned long long tail[INNER_SIZE][TAIL_WORDS];
+      Value value[INNER_SIZE];
+      int son_pos[INNER_SIZE + 1]{};
+    };
+
+    // a page as the storage keeps it, type (shared by both) tells which one it holds
+    union block {
+      leaf_block leaf;
+      inner_block inner;
+
+      block() : leaf() {}
+    };
+
+    static_assert(sizeof(leaf_block) <= PageBytes && sizeof(inner_block) <= PageBytes,
+                  "PageBytes is too small for a block");
+
+    // A compressed leaf keeps its entry count in block_size, the encoded entries take the bytes of lead,
+    // tail and value.
+    using codec = leaf_codec<index_value, Value>;
+    static constexpr long LEAF_BYTES = (sizeof(key_type) + sizeof(Value)) * LEAF_SIZE;
+
+    using page = page_handle<Storage<block, PageBytes>, block>;
+
+    // an inner block passed on the way down, pinned again when a split or merge reaches it
     struct path {
-      block data;
       long pos = -1;
+      int slot = -1; // which son the route continues with
+    };
+
+    // an update waiting in the buffer of an inner block, depth tells how far below the root
+    struct message {
+      index_value entry;
+      int insert = 1;
+      int depth = 0;
+    };
+
+    struct child {
+      index_value key; // smallest element below pos
+      long pos;
+    };
+
+    struct log_record {
+      bool insert;
+      index_value entry;
+      long long lsn;
     };
 
+    struct checkpoint_info {
+      map_info map;
+      storage_header storage;
+    };
+
+    // logging needs a storage that can keep dirty pages away from the file until a checkpoint
+    static constexpr bool LOGGABLE = requires(Storage<block, PageBytes> &storage) { storage.SetNoSteal(true); };
+    static constexpr long LOG_CACHE_PAGES = 64;
+    // InsertBatch hands at most this many entries to one leaf at a time, which bounds the pages it dirties
+    static constexpr size_t BATCH_GROUP = LEAF_SIZE * 8;
+    static constexpr long LEAF_LATCHES = 1024; // leaves share latches by pos modulo this
+
     std::fstream info_file;
     std::string info_file_name;
-    file_processor<block> data_processor;
+    Storage<block, PageBytes> data_processor;
     map_info map_information;
+    Keys keys;
+    write_ahead_log<log_record> log;
+    checkpoint_image<block, checkpoint_info> image;
+    chain_readahead<leaf_block, PageBytes, Storage<block, PageBytes>> readahead;
+    bloom_filter<key_type> filter;
+    page_versions<block, PageBytes, Storage> versions; // what the open snapshots see of the pages changed since
+
+    // automatic Sync after this many updates or milliseconds, 0 disables the trigger
+    long checkpoint_ops = 0, checkpoint_ms = 0;
+    long ops_since_sync = 0;
+    std::chrono::steady_clock::time_point last_sync = std::chrono::steady_clock::now();
+    bool lazy_delete = false; // deletes leave sparse leaves to Compact
+    long inner_splits = 0; // inner blocks split by ReplaceChild, which tells a flush that its route went stale
+    memtable<index_value> unmerged; // updates SetMemtable keeps out of the tree for now
+    long memtable_entries = 0; // 0 while there is no memtable
+    long long memtable_lsn = 0; // the lsn of the tree when the memtable took its first update
+
+    // Threads share the tree through these. Reads and the updates that stay inside one leaf hold tree_latch
+    // shared and the latch of their leaf; anything that changes inner blocks holds tree_latch exclusively.
+    mutable std::shared_mutex tree_latch;
+    std::shared_mutex leaf_latches[LEAF_LATCHES];
+    mutable std::mutex update_latch; // the log, lsn, size and sync counters while tree_latch is shared
+
+    // Updates only check the milliseconds trigger when they arrive, so once they stop this thread syncs
+    // what they left. SetCheckpoint starts it with the first milliseconds trigger.
+    std::thread sync_timer;
+    std::mutex timer_latch;
+    std::condition_variable timer_wake;
+    bool timer_stop = false;
 
   public:
-    bpt(const std::string &map, const std::string &data) :
-        info_file_name(map), data_processor(data) {
+    bpt(const std::string &map, const std::string &data, const long cache_pages = DEFAULT_CACHE_PAGES) :
+        info_file_name(map), data_processor(data, cache_pages), log(map + ".wal"), image(map + ".ckpt"),
+        readahead(data, data_processor), filter(map + ".bloom"), versions(map + ".snap") {
       bool info_file_exist = false;
       info_file.open(map);
       if (info_file.is_open()) {
@@ -129,629 +293,2511 @@ namespace sjtu {
         info_file.seekg(0);
         info_file.read(reinterpret_cast<char *>(&map_information), sizeof(map_information));
       } // if the map_file has data, read the overall information
+      info_file.clear(); // an older map file is shorter than map_info
+      Recover();
+      // a tree without elements takes the newest key format, any other keeps the one it was built with
+      if (map_information.root == -1) {
+        map_information.key_format = keys.Format();
+      } else {
+        keys.Open(map_information.key_format);
+      }
     }
     ~bpt() {
-      info_file.seekp(0);
-      info_file.write(reinterpret_cast<char *>(&map_information), sizeof(map_information));
+      if (sync_timer.joinable()) {
+        {
+          std::lock_guard<std::mutex> guard(timer_latch);
+          timer_stop = true;
+        }
+        timer_wake.notify_one();
+        sync_timer.join();
+      }
+      MergeMemtable();
+      if (log.Enabled()) {
+        SyncTree();
+      }
+      WriteInfo();
       info_file.close();
     }
 
     void Insert(const std::string &index, const Value &value) {
-      const index_value target = {db_hash(index), value};
-      if (map_information.root == -1) {
-        block first;
-        first.block_size = 1;
-        first.r_min[0] = target;
-        map_information.root = data_processor.WriteBlock(first);
-        map_information.head = map_information.root;
-        map_information.size = 1;
+      const index_value target = {keys.Make(index), value};
+      if (UpdateLeaf(true, target)) {
         return;
       }
+      std::unique_lock<std::shared_mutex> lock(tree_latch);
+      if (memtable_entries > 0) {
+        Absorb(true, target);
+      } else {
+        BeforeUpdate(true, target);
+        InsertEntry(target);
+      }
+      AfterUpdate();
+    }
 
-      block data = data_processor.ReadBlock(map_information.root);
-      long pos = map_information.root;
-      vector<path> route;
-      while (data.son_pos[0] != -1) {
-        route.push_back({data, pos});
-        int l = 0, r = data.block_size - 1;
-        while (r - l > 1) {
-          const int m = (r + l) >> 1;
-          if (data.r_min[m] < target) {
-            l = m;
-          } else {
-            r = m;
-          }
+    void Delete(const std::string &index, const Value &value) {
+      const index_value target = {keys.Make(index), value};
+      if (UpdateLeaf(false, target)) {
+        return;
+      }
+      std::unique_lock<std::shared_mutex> lock(tree_latch);
+      if (memtable_entries > 0) {
+        Absorb(false, target);
+      } else {
+        BeforeUpdate(false, target);
+        DeleteEntry(target);
+      }
+      AfterUpdate();
+    }
+
+    // write every dirty page and the overall information to disk in one step
+    void Sync() {
+      std::unique_lock<std::shared_mutex> lock(tree_latch);
+      SyncTree();
+    }
+
+    // Log every update before it touches a page; group_size records share one fdatasync.
+    // Pages then only reach the data file at checkpoints (Sync, or when half of the cache is dirty).
+    void EnableLog(const long group_size) {
+      static_assert(LOGGABLE, "the write-ahead log needs a storage that supports SetNoSteal");
+      std::unique_lock<std::shared_mutex> lock(tree_latch);
+      SyncTree();
+      if (data_processor.Capacity() < LOG_CACHE_PAGES) {
+        data_processor.SetCapacity(LOG_CACHE_PAGES);
+      }
+      data_processor.SetNoSteal(true);
+      log.Enable(group_size);
+    }
+
+    using entry = index_value;
+
+    entry MakeEntry(const std::string &index, const Value &value) {
+      return {keys.Make(index), value};
+    }
+
+    // Build the tree bottom-up from entries in increasing order (entry has operator<), as long as next(entry &)
+    // returns true. Leaves are packed and written one after another, then each inner level is built from the
+    // one below. Entries out of order are inserted one by one afterward, and a tree that is not empty just
+    // receives everything through Insert. The result is written to disk with Sync.
+    template <typename Source>
+    void BulkLoad(Source &&next) {
+      std::unique_lock<std::shared_mutex> lock(tree_latch);
+      MergeMemtable();
+      index_value item;
+      if (map_information.root != -1) {
+        while (next(item)) {
+          BeforeUpdate(true, item);
+          InsertEntry(item);
+          AfterUpdate();
         }
-        if (target < data.r_min[l]) {
-          pos = data.son_pos[l];
-        } else if (target < data.r_min[r]) {
-          pos = data.son_pos[r];
-        } else {
-          pos = data.son_pos[r + 1];
+        return;
+      }
+
+      // the pages are not logged, they go straight to the file and Sync makes them durable at the end
+      bool no_steal = false;
+      if constexpr (LOGGABLE) {
+        no_steal = log.Enabled();
+        if (no_steal) {
+          SyncTree();
+          data_processor.SetNoSteal(false);
         }
-        data = data_processor.ReadBlock(pos);
       }
-      int l = 0, r = data.block_size - 1;
-      while (r - l > 1) {
-        const int m = (r + l) >> 1;
-        if (data.r_min[m] == target) {
-          return;
+
+      vector<child> level;
+      vector<index_value> late, pending; // pending holds the leaf being filled
+      typename codec::sizer bytes;
+      long last_pos = -1; // the leaf written before
+      long long count = 0;
+      while (next(item)) {
+        if (count > 0) {
+          const index_value &last = pending.back();
+          if (item == last) {
+            continue;
+          }
+          if (item < last) {
+            late.push_back(item);
+            continue;
+          }
         }
-        if (data.r_min[m] < target) {
-          l = m;
-        } else {
-          r = m;
+        if (map_information.compressed ? bytes.With(item) > LEAF_BYTES : pending.size() == LEAF_SIZE - 1) {
+          leaf_block leaf;
+          FillLeaf(leaf, pending, 0, pending.size());
+          const long leaf_pos = Append(leaf);
+          level.push_back({pending[0], leaf_pos});
+          LinkLeaf(last_pos, leaf_pos);
+          last_pos = leaf_pos;
+          pending.clear();
+          bytes = typename codec::sizer();
         }
+        pending.push_back(item);
+        bytes.Add(item);
+        filter.Add(item.index);
+        ++count;
       }
-      if (data.r_min[l] == target || data.r_min[r] == target) {
+      if (count == 0) {
+        FinishBulk(no_steal);
         return;
       }
 
-      if (data.r_min[l] > target) {
-        for (int i = data.block_size - 1; i >= 0; --i) {
-          data.r_min[i + 1] = data.r_min[i];
+      // the last leaf may be short, even it out with the one before
+      if (last_pos != -1 && (map_information.compressed ? bytes.Bytes() < LEAF_BYTES / 4 : pending.size() < LEAF_SIZE / 2)) {
+        vector<index_value> both;
+        ReadLeaf(page(data_processor, last_pos)->leaf, both);
+        for (size_t i = 0; i < pending.size(); ++i) {
+          both.push_back(pending[i]);
         }
-        data.r_min[0] = target;
-      } else if (data.r_min[r] > target) {
-        for (int i = data.block_size - 1; i >= r; --i) {
-          data.r_min[i + 1] = data.r_min[i];
+        level.pop_back();
+        const vector<child> leaves = BuildLeaves(both, last_pos, -1);
+        for (size_t i = 0; i < leaves.size(); ++i) {
+          level.push_back(leaves[i]);
         }
-        data.r_min[r] = target;
       } else {
-        data.r_min[r + 1] = target;
+        leaf_block leaf;
+        FillLeaf(leaf, pending, 0, pending.size());
+        const long leaf_pos = Append(leaf);
+        level.push_back({pending[0], leaf_pos});
+        LinkLeaf(last_pos, leaf_pos);
       }
-      ++data.block_size;
-      ++map_information.size;
 
-      if (data.block_size == PAGE_SIZE) { // need to split leaf block
-        block new_block;
+      map_information.head = level[0].pos;
+      map_information.size = count;
+      while (level.size() > 1) {
+        level = BuildLevel(level);
+      }
+      map_information.root = level[0].pos;
 
-        // update size
-        new_block.block_size = data.block_size - data.block_size / 2;
-        data.block_size /= 2;
+      for (size_t i = 0; i < late.size(); ++i) {
+        InsertEntry(late[i]);
+      }
+      FinishBulk(no_steal);
+    }
 
-        // move data
-        for (int i = data.block_size; i < PAGE_SIZE; ++i) {
-          new_block.r_min[i - data.block_size] = data.r_min[i];
+    // Insert many pairs at once. They are sorted first, then each leaf is reached with a single descent,
+    // receives all of its entries and is split into as many leaves as it needs in one go.
+    void InsertBatch(std::span<const std::pair<std::string, Value>> batch) {
+      vector<index_value> entries;
+      for (size_t i = 0; i < batch.size(); ++i) {
+        entries.push_back({keys.Make(batch[i].first), batch[i].second});
+      }
+      if (entries.empty()) {
+        return;
+      }
+      std::sort(&entries[0], &entries[0] + entries.size());
+
+      std::unique_lock<std::shared_mutex> lock(tree_latch);
+      if (memtable_entries > 0) {
+        for (size_t i = 0; i < entries.size(); ++i) {
+          Absorb(true, entries[i]);
+        }
+        AfterUpdate(entries.size());
+        return;
+      }
+      for (size_t i = 0; i < entries.size(); ++i) {
+        filter.Add(entries[i].index);
+      }
+      if (Buffering()) { // the entries only join the buffer of the root
+        for (size_t i = 0; i < entries.size(); ++i) {
+          BeforeUpdate(true, entries[i]);
+          InsertEntry(entries[i]);
         }
+        AfterUpdate(entries.size());
+        return;
+      }
+      vector<message> messages;
+      for (size_t i = 0; i < entries.size(); ++i) {
+        messages.push_back({entries[i]});
+      }
+      ApplySorted(messages, true);
+      AfterUpdate(entries.size());
+    }
 
-        // reconnect the chain of blocks
-        new_block.next_block = data.next_block;
-        long new_block_pos = data_processor.WriteBlock(new_block);
-        data.next_block = new_block_pos;
-        data_processor.WriteBack(data, pos);
+    // Sync automatically every ops updates and/or after milliseconds have passed since the last one. The
+    // milliseconds trigger also fires when no update follows, from a thread that wakes up when it is due.
+    void SetCheckpoint(const long ops, const long milliseconds) {
+      {
+        std::unique_lock<std::shared_mutex> lock(tree_latch);
+        checkpoint_ops = ops;
+        checkpoint_ms = milliseconds;
+      }
+      std::lock_guard<std::mutex> guard(timer_latch);
+      if (milliseconds > 0 && !sync_timer.joinable()) {
+        sync_timer = std::thread(&bpt::RunTimer, this);
+      }
+      timer_wake.notify_one();
+    }
 
-        // find the place in the father block to insert data.r_min[data.block_size]
-        index_value to_insert = data.r_min[data.block_size];
+    // Store leaves in the compressed format of leaf_codec, which holds several times more entries with repeated
+    // indexes per page. The format is fixed once the tree has its first entry; returns the one in use.
+    bool SetLeafCompression(const bool on) {
+      std::unique_lock<std::shared_mutex> lock(tree_latch);
+      if (map_information.root == -1) {
+        map_information.compressed = on;
+      }
+      return map_information.compressed;
+    }
 
-        if (route.empty()) { // this is already the root
-          block new_root;
-          new_root.block_size = 1;
-          new_root.r_min[0] = to_insert;
-          new_root.son_pos[0] = pos;
-          new_root.son_pos[1] = new_block_pos;
-          map_information.root = data_processor.WriteBlock(new_root);
-          return;
-        }
+    // Keep a buffer of pending inserts and deletes in every inner block, like a B-epsilon tree. An update then
+    // only joins the buffer of the root; a full buffer hands the messages for the son that has the most of them
+    // one level down in a single write, so random updates reach each leaf in batches instead of one at a time.
+    // Find merges the messages on its way down with the leaves, while scans (Walk, cursors, snapshots) and
+    // Size() let every message reach its leaf first. Deletes leave sparse leaves like SetLazyDelete. The mode
+    // is fixed once the tree has its first entry; returns the one in use.
+    bool SetBuffered(const bool on) {
+      static_assert(BUFFER_SIZE > 0, "PageBytes is too small for buffered inner blocks");
+      std::unique_lock<std::shared_mutex> lock(tree_latch);
+      if (map_information.root == -1) {
+        map_information.buffered = on;
+      }
+      return map_information.buffered;
+    }
 
-        // insert into existed father block
-        data = route.back().data;
-        l = 0, r = data.block_size - 1;
-        while (r - l > 1) {
-          const int m = (r + l) >> 1;
-          if (data.r_min[m] < to_insert) {
-            l = m;
-          } else {
-            r = m;
-          }
-        }
-        if (data.r_min[l] > to_insert) {
-          for (int i = data.block_size - 1; i >= 0; --i) {
-            data.r_min[i + 1] = data.r_min[i];
-            data.son_pos[i + 2] = data.son_pos[i + 1];
-          }
-          data.r_min[0] = to_insert;
-          data.son_pos[1] = new_block_pos;
-        } else if (data.r_min[r] > to_insert) {
-          for (int i = data.block_size - 1; i >= r; --i) {
-            data.r_min[i + 1] = data.r_min[i];
-            data.son_pos[i + 2] = data.son_pos[i + 1];
-          }
-          data.r_min[r] = to_insert;
-          data.son_pos[r + 1] = new_block_pos;
-        } else {
-          data.r_min[data.block_size] = to_insert;
-          data.son_pos[data.block_size + 1] = new_block_pos;
-        }
-        ++data.block_size;
-        pos = route.back().pos; // now data is of father block, pos is father's pos
-        route.pop_back();
-      } else { // leaf block is not full, directly write back and return
-        data_processor.WriteBack(data, pos);
-        return;
+    // Keep Insert and Delete in a sorted table in memory (a skip list) until it holds entries updates, then
+    // merge them into the tree in key order: each leaf they touch is reached with one descent and rewritten
+    // once, as InsertBatch does. Find and Count merge the table with the leaves; scans, snapshots, Size(),
+    // Compact and Sync merge it first. Leaves its deletes thin out are left to Compact. With the log on, an
+    // update is logged before the table takes it, and checkpoints keep the log while the table holds anything.
+    // 0 merges the table and drops it.
+    void SetMemtable(const long entries) {
+      std::unique_lock<std::shared_mutex> lock(tree_latch);
+      memtable_entries = entries;
+      if (unmerged.Size() >= entries) {
+        MergeMemtable();
       }
+    }
 
-      while (data.block_size == PAGE_SIZE) { // need to split non-leaf block and update father block
-        block new_block;
+    // hand every buffered message down to its leaf, and merge the memtable
+    void Flush() {
+      std::unique_lock<std::shared_mutex> lock(tree_latch);
+      FlushAll();
+    }
 
-        // update size
-        new_block.block_size = data.block_size - data.block_size / 2 - 1;
-        data.block_size /= 2;
+    // Take entries out of their leaf without borrowing or merging, so a delete writes the page of its leaf and
+    // nothing else, and almost always runs alongside other threads (see UpdateLeaf). Leaves may then run sparse
+    // or empty until Compact merges them.
+    void SetLazyDelete(const bool on) {
+      std::unique_lock<std::shared_mutex> lock(tree_latch);
+      lazy_delete = on;
+    }
 
-        // move data
-        for (int i = data.block_size + 1; i < PAGE_SIZE; ++i) {
-          new_block.r_min[i - data.block_size - 1] = data.r_min[i];
-          new_block.son_pos[i - data.block_size - 1] = data.son_pos[i];
+    // Merge the sparse leaves that deletes left behind, in key order. A leaf is sparse below LEAF_SIZE / 2
+    // entries, or a quarter of its bytes if compressed; neighbours under the same father become one leaf when
+    // one of them is sparse and their entries fit. When the log needs a checkpoint, the father being merged
+    // is rewritten to a whole state first (see CompactFather), so a crash leaves a whole tree. A tree without
+    // entries gives back all of its pages.
+    void Compact() {
+      std::unique_lock<std::shared_mutex> lock(tree_latch);
+      FlushAll();
+      if (map_information.root == -1) {
+        return;
+      }
+      vector<long> pages, fathers;
+      CollectPages(map_information.root, pages, fathers);
+      if (map_information.size == 0) {
+        map_information.root = -1;
+        map_information.head = -1;
+        for (size_t i = 0; i < pages.size(); ++i) {
+          CheckpointIfFull();
+          Free(pages[i]);
         }
-        new_block.son_pos[new_block.block_size] = data.son_pos[PAGE_SIZE];
-
-        // write down blocks after split
-        long new_block_pos = data_processor.WriteBlock(new_block);
-        data_processor.WriteBack(data, pos);
+        return;
+      }
+      for (size_t i = 0; i < fathers.size(); ++i) {
+        CheckpointIfFull();
+        CompactFather(fathers[i]);
+      }
+    }
 
-        // find the place in the father block to insert data.r_min[data.block_size]
-        index_value to_insert = data.r_min[data.block_size];
-        if (route.empty()) {
-          block new_root;
-          new_root.block_size = 1;
-          new_root.r_min[0] = to_insert;
-          new_root.son_pos[0] = pos;
-          new_root.son_pos[1] = new_block_pos;
-          map_information.root = data_processor.WriteBlock(new_root);
+  private:
+    void SyncTree() {
+      MergeMemtable();
+      if constexpr (LOGGABLE) {
+        if (log.Enabled()) {
+          Checkpoint();
+          ops_since_sync = 0;
+          last_sync = std::chrono::steady_clock::now();
           return;
         }
+      }
+      WriteInfo();
+      data_processor.Sync();
+      SyncPath(info_file_name);
+      ops_since_sync = 0;
+      last_sync = std::chrono::steady_clock::now();
+    }
 
-        // insert into the father block
-        data = route.back().data;
-        l = 0, r = data.block_size - 1;
-        while (r - l > 1) {
-          const int m = (r + l) >> 1;
-          if (data.r_min[m] < to_insert) {
-            l = m;
-          } else {
-            r = m;
-          }
-        }
-        if (data.r_min[l] > to_insert) {
-          for (int i = data.block_size - 1; i >= 0; --i) {
-            data.r_min[i + 1] = data.r_min[i];
-            data.son_pos[i + 2] = data.son_pos[i + 1];
-          }
-          data.r_min[0] = to_insert;
-          data.son_pos[1] = new_block_pos;
-        } else if (data.r_min[r] > to_insert) {
-          for (int i = data.block_size - 1; i >= r; --i) {
-            data.r_min[i + 1] = data.r_min[i];
-            data.son_pos[i + 2] = data.son_pos[i + 1];
-          }
-          data.r_min[r] = to_insert;
-          data.son_pos[r + 1] = new_block_pos;
-        } else {
-          data.r_min[data.block_size] = to_insert;
-          data.son_pos[data.block_size + 1] = new_block_pos;
-        }
-        ++data.block_size;
-        pos = route.back().pos;
-        route.pop_back();
+    // the pages the cache writes back when it is resized must not bypass the checkpoint image
+    void BeforeResize() {
+      if (log.Enabled()) {
+        SyncTree();
       }
+    }
 
-      // write back the changed but not split father block
-      data_processor.WriteBack(data, pos);
+    void AfterResize() {
+      if (log.Enabled() && data_processor.Capacity() < LOG_CACHE_PAGES) {
+        data_processor.SetCapacity(LOG_CACHE_PAGES);
+      }
     }
 
-    void Delete(const std::string &index, const Value &value) {
-      const index_value target = {db_hash(index), value};
-      if (map_information.root == -1) {
-        return;
+    // Write the dirty pages to the image first and only then to their place in the data file,
+    // so that a crash at any point leaves either the old or the new checkpoint recoverable.
+    // The updates in the memtable are only in the log, which stays while it holds any; the tree claims no
+    // more than the lsn it had before them, so they are all replayed. An update that had been merged already
+    // is replayed over itself, and the last update of each element still decides the result.
+    void Checkpoint(const bool drop_log = true) {
+      const long long lsn = map_information.lsn;
+      const bool keep_log = !unmerged.Empty();
+      if (keep_log) {
+        map_information.lsn = memtable_lsn;
+      }
+      log.Commit();
+      image.Begin();
+      data_processor.ForEachDirty([this](const long index, const block &page) { image.Add(index, page); });
+      SaveFilter();
+      image.Commit({map_information, data_processor.Header()});
+      data_processor.Sync();
+      WriteInfo();
+      SyncPath(info_file_name);
+      map_information.lsn = lsn;
+      if (drop_log && !keep_log) {
+        log.Reset();
       }
+      image.Reset();
+    }
 
-      // may need to reset root and head to -1
-      if (map_information.size == 1) {
-        block single_block = data_processor.ReadBlock(map_information.root);
-        if (single_block.r_min[0] == target) {
-          map_information.root = -1;
-          map_information.head = -1;
-          map_information.size = 0;
+    // finish an interrupted checkpoint, then redo the logged updates that the tree does not contain yet
+    void Recover() {
+      if constexpr (LOGGABLE) {
+        checkpoint_info saved;
+        if (image.Restore(saved, [this](const long index, block &page) { data_processor.WriteBack(page, index); })) {
+          map_information = saved.map;
+          data_processor.SetHeader(saved.storage);
+          data_processor.Sync();
+          WriteInfo();
+          SyncPath(info_file_name);
+          image.Reset();
         }
-        return;
+        CheckFilter();
+        if (log.Empty()) {
+          return;
+        }
+        if (data_processor.Capacity() < LOG_CACHE_PAGES) {
+          data_processor.SetCapacity(LOG_CACHE_PAGES);
+        }
+        data_processor.SetNoSteal(true);
+        log.Replay([this](const log_record &record) {
+          if (record.lsn <= map_information.lsn) {
+            return;
+          }
+          if (data_processor.DirtyPages() * 2 >= data_processor.Capacity()) {
+            Checkpoint(false); // the rest of the log is still needed
+          }
+          if (record.insert) {
+            InsertEntry(record.entry);
+          } else {
+            DeleteEntry(record.entry);
+          }
+          map_information.lsn = record.lsn;
+        });
+        Checkpoint();
+        data_processor.SetNoSteal(false);
+      } else {
+        CheckFilter();
       }
+    }
 
-      // record the route when trying to find the leaf block
-      block data = data_processor.ReadBlock(map_information.root);
-      long pos = map_information.root;
-      vector<path> route;
-      while (data.son_pos[0] != -1) {
-        route.push_back({data, pos});
-        int l = 0, r = data.block_size - 1;
-        while (r - l > 1) {
-          const int m = (r + l) >> 1;
-          if (data.r_min[m] < target) {
-            l = m;
-          } else {
-            r = m;
+    // A filter saved with other information than the tree now has may miss indexes, build it from the tree.
+    // Runs before the log is replayed, which adds its indexes to the filter.
+    void CheckFilter() {
+      if (filter.Enabled() && filter.Generation() != map_information.filter_generation) {
+        BuildFilter(filter.BitsPerKey(), 0);
+      }
+    }
+
+    void BuildFilter(const int bits_per_key, const long long keys) {
+      filter.Reset(bits_per_key, std::max(keys, map_information.size + map_information.messages + unmerged.Size()));
+      Walk(key_type(), [this](const index_value &entry) {
+        filter.Add(entry.index);
+        return true;
+      });
+      if (map_information.messages > 0) { // the buffered inserts are not in the leaves yet
+        vector<long> pages, fathers;
+        vector<message> messages;
+        CollectPages(map_information.root, pages, fathers);
+        for (size_t i = 0; i < pages.size(); ++i) {
+          const page node(data_processor, pages[i]);
+          if (node->inner.type == INNER_PAGE) {
+            LoadBuffer(node->inner, messages);
+            for (size_t j = 0; j < messages.size(); ++j) {
+              if (messages[j].insert) {
+                filter.Add(messages[j].entry.index);
+              }
+            }
           }
         }
-        if (target < data.r_min[l]) {
-          pos = data.son_pos[l];
-        } else if (target < data.r_min[r]) {
-          pos = data.son_pos[r];
-        } else {
-          pos = data.son_pos[r + 1];
+      }
+      for (long i = unmerged.First(); i != -1; i = unmerged.Next(i)) {
+        if (unmerged.Inserts(i)) {
+          filter.Add(unmerged.At(i).index);
         }
-        data = data_processor.ReadBlock(pos);
       }
+    }
 
-      // now the data block is leaf block
-      int l = 0, r = data.block_size - 1;
-      while (r - l > 1) {
-        const int m = (r + l) >> 1;
-        if (data.r_min[m] < target) {
-          l = m;
-        } else {
-          r = m;
-        }
+    // a changed filter is saved under the next generation before the information that refers to it
+    void SaveFilter() {
+      if (filter.Dirty()) {
+        filter.Save(++map_information.filter_generation);
       }
-      if (data.r_min[l] == target) {
-        for (int i = l + 1; i < data.block_size; ++i) {
-          data.r_min[i - 1] = data.r_min[i];
-        }
-        --data.block_size;
-        --map_information.size;
-      } else if (data.r_min[r] == target) {
-        for (int i = r + 1; i < data.block_size; ++i) {
-          data.r_min[i - 1] = data.r_min[i];
-        }
-        --data.block_size;
-        --map_information.size;
-      } else {
-        return;
+    }
+
+    void LinkLeaf(const long from, const long to) {
+      if (from != -1) {
+        page leaf(data_processor, from);
+        Modify(leaf).leaf.next_block = to;
       }
+    }
 
-      // target has been deleted, now check the size of the block
-      // when merging at the leaf block, just ignore the r_min of father and merge
-      if (data.block_size < PAGE_SIZE / 2) {
-        if (route.empty()) { // it is allowed to have less than PAGE_SIZE / 2 elements in root block
-          data_processor.WriteBack(data, pos);
-          return;
+    // Walk from the root to the leaf that target belongs to and return it pinned. The inner blocks passed are
+    // recorded in route, and fence becomes the smallest separator above target if bounded is set.
+    page Descend(const index_value &target, vector<path> &route, bool &bounded, index_value &fence) {
+      page node(data_processor, map_information.root);
+      while (node->inner.type == INNER_PAGE) {
+        const int slot = node->inner.UpperBound(target);
+        if (slot < node->inner.block_size) {
+          bounded = true;
+          fence = node->inner.Key(slot);
         }
+        route.push_back({node.Index(), slot});
+        node = page(data_processor, node->inner.son_pos[slot]);
+      }
+      return node;
+    }
 
-        block father = route.back().data, l_brother, r_brother;
-        long father_pos = route.back().pos, l_brother_pos = -1, r_brother_pos = -1;
-        int target_block_ind;
-        route.pop_back();
-        l = 0, r = father.block_size - 1;
-        while (r - l > 1) {
+    page Descend(const index_value &target, vector<path> &route) {
+      bool bounded = false;
+      index_value fence;
+      return Descend(target, route, bounded, fence);
+    }
+
+    // let the open snapshots keep page pos as it is before it changes
+    void Preserve(const long pos) {
+      versions.Preserve(pos, [this, pos] { return data_processor.ReadBlock(pos); });
+    }
+
+    void Free(const long pos) {
+      Preserve(pos);
+      data_processor.Release(pos);
+    }
+
+    // the block of a pinned page, to be changed in place
+    block &Modify(page &node) {
+      Preserve(node.Index());
+      return node.Edit();
+    }
+
+    // write a block to page pos, or to a new page whose pos is returned
+    void Store(const leaf_block &leaf, const long pos) {
+      Preserve(pos);
+      block page;
+      page.leaf = leaf;
+      data_processor.WriteBack(page, pos);
+    }
+
+    void Store(const inner_block &inner, const long pos) {
+      Preserve(pos);
+      block page;
+      page.inner = inner;
+      data_processor.WriteBack(page, pos);
+    }
+
+    long Append(const leaf_block &leaf) {
+      block page;
+      page.leaf = leaf;
+      return data_processor.WriteBlock(page);
+    }
+
+    long Append(const inner_block &inner) {
+      block page;
+      page.inner = inner;
+      return data_processor.WriteBlock(page);
+    }
+
+    static unsigned char *LeafBytes(leaf_block &leaf) {
+      return reinterpret_cast<unsigned char *>(leaf.lead);
+    }
+
+    static const unsigned char *LeafBytes(const leaf_block &leaf) {
+      return reinterpret_cast<const unsigned char *>(leaf.lead);
+    }
+
+    // the entries of a leaf in either format
+    void ReadLeaf(const leaf_block &leaf, vector<index_value> &entries) const {
+      ReadLeaf(leaf, entries, map_information.compressed);
+    }
+
+    static void ReadLeaf(const leaf_block &leaf, vector<index_value> &entries, const bool compressed) {
+      entries.clear();
+      if (compressed) {
+        codec::Decode(LeafBytes(leaf), leaf.bytes, [&entries](const index_value &entry) { entries.push_back(entry); });
+      } else {
+        for (int i = 0; i < leaf.block_size; ++i) {
+          entries.push_back(leaf.Key(i));
+        }
+      }
+    }
+
+    // make leaf hold entries[begin, begin + n), which must fit
+    void FillLeaf(leaf_block &leaf, const vector<index_value> &entries, const long begin, const long n) const {
+      leaf.block_size = n;
+      if (map_information.compressed) {
+        leaf.bytes = n == 0 ? 0 : codec::Encode(&entries[begin], n, LeafBytes(leaf));
+      } else {
+        for (long i = 0; i < n; ++i) {
+          leaf.SetKey(i, entries[begin + i]);
+        }
+      }
+    }
+
+    long EncodedSize(const vector<index_value> &entries) const {
+      return entries.empty() ? 0 : codec::Size(&entries[0], entries.size());
+    }
+
+    // Pack the children into as few inner blocks as possible, spreading them evenly so that none of the
+    // blocks falls below INNER_SIZE / 2 elements, and return the blocks as the children of the next level.
+    // The first block goes to reuse_pos if it is given.
+    vector<child> BuildLevel(const vector<child> &children, const long reuse_pos = -1) {
+      vector<child> parents;
+      const long n = children.size();
+      const long fanout = map_information.buffered ? BUFFERED_FANOUT : INNER_SIZE;
+      const long count = (n + fanout - 1) / fanout;
+      long begin = 0;
+      for (long j = 0; j < count; ++j) {
+        const long sons = n / count + (j < n % count ? 1 : 0);
+        inner_block node;
+        node.block_size = sons - 1;
+        node.son_pos[0] = children[begin].pos;
+        for (long i = 1; i < sons; ++i) {
+          node.SetKey(i - 1, children[begin + i].key);
+          node.son_pos[i] = children[begin + i].pos;
+        }
+        if (j == 0 && reuse_pos != -1) {
+          Store(node, reuse_pos);
+          parents.push_back({children[begin].key, reuse_pos});
+        } else {
+          parents.push_back({children[begin].key, Append(node)});
+        }
+        begin += sons;
+      }
+      return parents;
+    }
+
+    // Same for a leaf: spread the sorted entries over as few leaves as possible, the first one at pos,
+    // chain them in front of next_block and return them as children for the level above.
+    // Compressed leaves are cut by their encoded size instead of their count.
+    vector<child> BuildLeaves(const vector<index_value> &entries, const long pos, const long next_block) {
+      vector<long> sizes;
+      const long n = entries.size();
+      if (map_information.compressed) {
+        const long total = EncodedSize(entries);
+        const long count = (total + LEAF_BYTES - 1) / LEAF_BYTES;
+        const long share = count <= 1 ? LEAF_BYTES : (total + count - 1) / count;
+        typename codec::sizer bytes;
+        long size = count <= 1 ? n : 0; // entries that fit in one leaf need no cut
+        for (long i = size; i < n; ++i) {
+          if (size > 0 && bytes.With(entries[i]) > share) {
+            sizes.push_back(size);
+            bytes = typename codec::sizer();
+            size = 0;
+          }
+          bytes.Add(entries[i]);
+          ++size;
+        }
+        sizes.push_back(size);
+      } else {
+        const long count = (n + LEAF_SIZE - 2) / (LEAF_SIZE - 1);
+        for (long j = 0; j < count; ++j) {
+          sizes.push_back(n / count + (j < n % count ? 1 : 0));
+        }
+      }
+      vector<child> leaves;
+      long begin = 0;
+      leaf_block empty;
+      for (size_t j = 0; j < sizes.size(); ++j) {
+        leaves.push_back({entries[begin], j == 0 ? pos : Append(empty)});
+        begin += sizes[j];
+      }
+      begin = 0;
+      for (size_t j = 0; j < sizes.size(); ++j) {
+        leaf_block leaf;
+        FillLeaf(leaf, entries, begin, sizes[j]);
+        leaf.next_block = j + 1 < sizes.size() ? leaves[j + 1].pos : next_block;
+        Store(leaf, leaves[j].pos);
+        begin += sizes[j];
+      }
+      return leaves;
+    }
+
+    // The son that route ends in has been split into blocks. Replace it by them in its father, splitting the
+    // fathers as far up as needed, and grow a new root if the old one had to be split.
+    void ReplaceChild(vector<path> &route, vector<child> blocks) {
+      while (blocks.size() > 1) {
+        if (route.empty()) {
+          while (blocks.size() > 1) {
+            blocks = BuildLevel(blocks);
+          }
+          map_information.root = blocks[0].pos;
+          return;
+        }
+        const int slot = route.back().slot;
+        vector<child> children;
+        vector<message> messages;
+        {
+          const page node(data_processor, route.back().pos);
+          const inner_block &father = node->inner;
+          if (map_information.buffered) {
+            LoadBuffer(father, messages);
+          }
+          for (int i = 0; i <= father.block_size; ++i) {
+            // the key of the first son only matters as the separator in front of it, it is kept as it was
+            const index_value key = i == 0 ? father.Key(0) : father.Key(i - 1);
+            if (i == slot) {
+              children.push_back({key, blocks[0].pos});
+              for (size_t j = 1; j < blocks.size(); ++j) {
+                children.push_back(blocks[j]);
+              }
+            } else {
+              children.push_back({key, father.son_pos[i]});
+            }
+          }
+        }
+        blocks = BuildLevel(children, route.back().pos);
+        SpreadBuffer(blocks, messages);
+        if (blocks.size() > 1) {
+          ++inner_splits;
+        }
+        route.pop_back();
+      }
+    }
+
+    // entries becomes stored changed by messages[begin, end), which are sorted; of equal messages the last one
+    // counts. Returns the change in the number of entries.
+    static long MergeMessages(const vector<index_value> &stored, const vector<message> &messages, const size_t begin,
+                              const size_t end, vector<index_value> &entries) {
+      entries.clear();
+      size_t l = 0;
+      for (size_t j = begin; j < end; ++j) {
+        if (j + 1 < end && messages[j + 1].entry == messages[j].entry) {
+          continue;
+        }
+        while (l < stored.size() && stored[l] < messages[j].entry) {
+          entries.push_back(stored[l++]);
+        }
+        if (l < stored.size() && stored[l] == messages[j].entry) {
+          ++l;
+        }
+        if (messages[j].insert) {
+          entries.push_back(messages[j].entry);
+        }
+      }
+      while (l < stored.size()) {
+        entries.push_back(stored[l++]);
+      }
+      return static_cast<long>(entries.size()) - static_cast<long>(stored.size());
+    }
+
+    // Apply sorted messages to a tree without buffers, reaching each leaf with a single descent and rebuilding
+    // it with all of its messages at once. Leaves that deletes empty or thin out stay for Compact. The messages
+    // of each leaf are logged just before it changes if append_log is set.
+    void ApplySorted(const vector<message> &messages, const bool append_log) {
+      vector<path> route;
+      vector<index_value> stored, entries;
+      size_t i = 0;
+      while (i < messages.size()) {
+        if (map_information.root == -1) { // an empty tree starts from the next insert
+          if (messages[i].insert) {
+            if (append_log) {
+              BeforeUpdate(true, messages[i].entry);
+            }
+            InsertEntry(messages[i].entry);
+          }
+          ++i;
+          continue;
+        }
+        CheckpointIfFull();
+
+        // find the leaf of messages[i] and the first element that belongs to a leaf after it
+        route.clear();
+        bool bounded = false;
+        index_value fence;
+        page leaf = Descend(messages[i].entry, route, bounded, fence);
+        size_t end = i;
+        while (end < messages.size() && end - i < BATCH_GROUP && (!bounded || messages[end].entry < fence)) {
+          ++end;
+        }
+        const long pos = leaf.Index(), next_block = leaf->leaf.next_block;
+        ReadLeaf(leaf->leaf, stored);
+        leaf.Reset();
+
+        if constexpr (LOGGABLE) {
+          if (append_log && log.Enabled()) {
+            for (size_t j = i; j < end; ++j) {
+              log.Append({static_cast<bool>(messages[j].insert), messages[j].entry, ++map_information.lsn});
+            }
+          }
+        }
+        map_information.size += MergeMessages(stored, messages, i, end, entries);
+        i = end;
+        if (!entries.empty()) {
+          ReplaceChild(route, BuildLeaves(entries, pos, next_block));
+        } else if (route.empty()) {
+          Free(pos);
+          map_information.root = -1;
+          map_information.head = -1;
+        } else {
+          leaf_block empty;
+          empty.next_block = next_block;
+          Store(empty, pos);
+        }
+      }
+    }
+
+    // end of a bulk operation: make it durable and go back to logging if it was on
+    void FinishBulk(const bool no_steal) {
+      SyncTree();
+      if constexpr (LOGGABLE) {
+        if (no_steal) {
+          data_processor.SetNoSteal(true);
+        }
+      }
+    }
+
+    // with the log on, dirty pages go out in a checkpoint before they take half of the cache
+    // whether the log needs a checkpoint before more pages get dirty
+    bool CheckpointDue() const {
+      if constexpr (LOGGABLE) {
+        return log.Enabled() && data_processor.DirtyPages() * 2 >= data_processor.Capacity();
+      }
+      return false;
+    }
+
+    void CheckpointIfFull() {
+      if constexpr (LOGGABLE) {
+        if (CheckpointDue()) {
+          Checkpoint();
+        }
+      }
+    }
+
+    void BeforeUpdate(const bool insert, const index_value &target) {
+      CheckpointIfFull();
+      if constexpr (LOGGABLE) {
+        if (log.Enabled()) {
+          log.Append({insert, target, ++map_information.lsn});
+        }
+      }
+    }
+
+    void WriteInfo() {
+      SaveFilter();
+      info_file.seekp(0);
+      info_file.write(reinterpret_cast<char *>(&map_information), sizeof(map_information));
+      info_file.flush();
+    }
+
+    void AfterUpdate(const long ops = 1) {
+      if (SyncDue(ops)) {
+        SyncTree();
+      }
+    }
+
+    // The loop of sync_timer: Sync when the milliseconds trigger is due with updates pending, then sleep until
+    // it can be due again. An update after a longer pause syncs by itself (SyncDue).
+    void RunTimer() {
+      while (true) {
+        auto due = std::chrono::steady_clock::now() + std::chrono::seconds(1); // while the trigger is off
+        {
+          std::unique_lock<std::shared_mutex> lock(tree_latch);
+          if (checkpoint_ms > 0) {
+            const auto period = std::chrono::milliseconds(checkpoint_ms);
+            if (std::chrono::steady_clock::now() - last_sync >= period) {
+              if (ops_since_sync > 0) {
+                SyncTree();
+              }
+              due = std::chrono::steady_clock::now() + period;
+            } else {
+              due = last_sync + period;
+            }
+          }
+        }
+        std::unique_lock<std::mutex> guard(timer_latch);
+        if (!timer_stop) {
+          timer_wake.wait_until(guard, due); // SetCheckpoint wakes it early
+        }
+        if (timer_stop) {
+          return;
+        }
+      }
+    }
+
+    // count ops more updates and tell whether SetCheckpoint asks for a Sync now
+    bool SyncDue(const long ops) {
+      ops_since_sync += ops;
+      return (checkpoint_ops > 0 && ops_since_sync >= checkpoint_ops) ||
+             (checkpoint_ms > 0 && std::chrono::steady_clock::now() - last_sync >= std::chrono::milliseconds(checkpoint_ms));
+    }
+
+    // Keep an update in the memtable once it is logged, and merge the memtable when it is full.
+    void Absorb(const bool insert, const index_value &target) {
+      if (unmerged.Empty()) {
+        memtable_lsn = map_information.lsn;
+      }
+      BeforeUpdate(insert, target);
+      if (insert) {
+        filter.Add(target.index);
+      }
+      unmerged.Put(target, insert);
+      if (unmerged.Size() >= memtable_entries) {
+        MergeMemtable();
+      }
+    }
+
+    // Apply the memtable to the tree in key order and empty it. A buffered tree takes the updates into its
+    // buffers like any others.
+    void MergeMemtable() {
+      if (unmerged.Empty()) {
+        return;
+      }
+      vector<message> messages;
+      for (long i = unmerged.First(); i != -1; i = unmerged.Next(i)) {
+        messages.push_back({unmerged.At(i), unmerged.Inserts(i)});
+      }
+      if (map_information.buffered) {
+        for (size_t i = 0; i < messages.size(); ++i) {
+          CheckpointIfFull();
+          if (messages[i].insert) {
+            InsertEntry(messages[i].entry);
+          } else {
+            DeleteEntry(messages[i].entry);
+          }
+        }
+      } else {
+        ApplySorted(messages, false);
+      }
+      unmerged.Clear();
+    }
+
+    void InsertEntry(const index_value &target) {
+      filter.Add(target.index);
+      if (Buffering()) {
+        Buffer(true, target);
+        return;
+      }
+      if (map_information.compressed) {
+        InsertCompressed(target);
+        return;
+      }
+      if (map_information.root == -1) {
+        leaf_block first;
+        first.block_size = 1;
+        first.SetKey(0, target);
+        map_information.root = Append(first);
+        map_information.head = map_information.root;
+        map_information.size = 1;
+        return;
+      }
+
+      vector<path> route;
+      page leaf = Descend(target, route);
+      long pos = leaf.Index();
+      const int at = leaf->leaf.LowerBound(target);
+      if (at < leaf->leaf.block_size && leaf->leaf.Key(at) == target) {
+        return;
+      }
+      leaf_block &data = Modify(leaf).leaf;
+      for (int i = data.block_size - 1; i >= at; --i) {
+        data.SetKey(i + 1, data.Key(i));
+      }
+      data.SetKey(at, target);
+      ++data.block_size;
+      ++map_information.size;
+
+      if (data.block_size < LEAF_SIZE) { // leaf block is not full, it is written back as it is
+        return;
+      }
+
+      // need to split leaf block
+      leaf_block new_leaf;
+
+      // update size
+      new_leaf.block_size = data.block_size - data.block_size / 2;
+      data.block_size /= 2;
+
+      // move data
+      for (int i = data.block_size; i < LEAF_SIZE; ++i) {
+        new_leaf.SetKey(i - data.block_size, data.Key(i));
+      }
+
+      // reconnect the chain of blocks
+      new_leaf.next_block = data.next_block;
+      long new_block_pos = Append(new_leaf);
+      data.next_block = new_block_pos;
+
+      // find the place in the father block to insert data.Key(data.block_size)
+      index_value to_insert = data.Key(data.block_size);
+      leaf.Reset();
+
+      while (true) {
+        if (route.empty()) { // this is already the root
+          inner_block new_root;
+          new_root.block_size = 1;
+          new_root.SetKey(0, to_insert);
+          new_root.son_pos[0] = pos;
+          new_root.son_pos[1] = new_block_pos;
+          map_information.root = Append(new_root);
+          return;
+        }
+
+        // insert into the father block
+        page father(data_processor, route.back().pos);
+        inner_block &node = Modify(father).inner;
+        const int slot = node.UpperBound(to_insert);
+        for (int i = node.block_size - 1; i >= slot; --i) {
+          node.SetKey(i + 1, node.Key(i));
+          node.son_pos[i + 2] = node.son_pos[i + 1];
+        }
+        node.SetKey(slot, to_insert);
+        node.son_pos[slot + 1] = new_block_pos;
+        ++node.block_size;
+        pos = route.back().pos; // now node is the father block, pos is father's pos
+        route.pop_back();
+
+        if (node.block_size < INNER_SIZE) {
+          return;
+        }
+
+        // need to split non-leaf block and update father block
+        inner_block new_block;
+
+        // update size
+        new_block.block_size = node.block_size - node.block_size / 2 - 1;
+        node.block_size /= 2;
+
+        // move data
+        for (int i = node.block_size + 1; i < INNER_SIZE; ++i) {
+          new_block.SetKey(i - node.block_size - 1, node.Key(i));
+          new_block.son_pos[i - node.block_size - 1] = node.son_pos[i];
+        }
+        new_block.son_pos[new_block.block_size] = node.son_pos[INNER_SIZE];
+
+        // write down the new block, node goes back when father lets go of it
+        new_block_pos = Append(new_block);
+
+        // find the place in the father block to insert node.Key(node.block_size)
+        to_insert = node.Key(node.block_size);
+      }
+    }
+
+    void DeleteEntry(const index_value &target) {
+      if (map_information.root == -1) {
+        return;
+      }
+      if (Buffering()) {
+        Buffer(false, target);
+        return;
+      }
+      if (map_information.compressed) {
+        DeleteCompressed(target);
+        return;
+      }
+
+      // may need to reset root and head to -1; after lazy deletes the last entry need not be in the root
+      if (map_information.size == 1) {
+        const page root(data_processor, map_information.root);
+        if (root->leaf.type == LEAF_PAGE) {
+          if (root->leaf.Key(0) == target) {
+            Free(map_information.root);
+            map_information.root = -1;
+            map_information.head = -1;
+            map_information.size = 0;
+          }
+          return;
+        }
+      }
+
+      // record the route when trying to find the leaf block
+      vector<path> route;
+      page leaf = Descend(target, route);
+      const long pos = leaf.Index();
+
+      // now the data block is leaf block
+      const int at = leaf->leaf.LowerBound(target);
+      if (at == leaf->leaf.block_size || leaf->leaf.Key(at) != target) {
+        return;
+      }
+      leaf_block &data = Modify(leaf).leaf;
+      for (int i = at + 1; i < data.block_size; ++i) {
+        data.SetKey(i - 1, data.Key(i));
+      }
+      --data.block_size;
+      --map_information.size;
+
+      // target has been deleted, now check the size of the block
+      // it is allowed to have less than LEAF_SIZE / 2 elements in root block, and in any with lazy deletes
+      if (data.block_size >= LEAF_SIZE / 2 || route.empty() || lazy_delete) {
+        return;
+      }
+
+      // when merging at the leaf block, just ignore the keys of father and merge
+      page father_page(data_processor, route.back().pos), l_page, r_page;
+      inner_block &father = Modify(father_page).inner;
+      long father_pos = route.back().pos, l_brother_pos = -1, r_brother_pos = -1;
+      int target_block_ind;
+      route.pop_back();
+      int l = 0, r = father.block_size - 1;
+      while (r - l > 1) {
+        const int m = (r + l) >> 1;
+        if (father.Key(m) <= target) {
+          l = m;
+        } else {
+          r = m;
+        }
+      }
+      if (target < father.Key(l)) {
+        r_brother_pos = father.son_pos[l + 1];
+        r_page = page(data_processor, r_brother_pos);
+        target_block_ind = 0;
+      } else if (target < father.Key(r)) {
+        l_brother_pos = father.son_pos[l];
+        r_brother_pos = father.son_pos[r + 1];
+        l_page = page(data_processor, l_brother_pos);
+        r_page = page(data_processor, r_brother_pos);
+        target_block_ind = r;
+      } else {
+        l_brother_pos = father.son_pos[r];
+        l_page = page(data_processor, l_brother_pos);
+        target_block_ind = r + 1;
+      }
+
+      // try to borrow an element from l_brother or r_brother
+      if (l_brother_pos != -1 && l_page->leaf.block_size > LEAF_SIZE / 2) {
+        leaf_block &l_brother = Modify(l_page).leaf;
+        for (int i = data.block_size - 1; i >= 0; --i) {
+          data.SetKey(i + 1, data.Key(i));
+        }
+        data.SetKey(0, l_brother.Key(l_brother.block_size - 1));
+        ++data.block_size;
+        father.SetKey(target_block_ind - 1, data.Key(0));
+        --l_brother.block_size;
+        return;
+      }
+      if (r_brother_pos != -1 && r_page->leaf.block_size > LEAF_SIZE / 2) {
+        leaf_block &r_brother = Modify(r_page).leaf;
+        data.SetKey(data.block_size, r_brother.Key(0));
+        ++data.block_size;
+        father.SetKey(target_block_ind, r_brother.Key(1));
+        for (int i = 1; i < r_brother.block_size; ++i) {
+          r_brother.SetKey(i - 1, r_brother.Key(i));
+        }
+        --r_brother.block_size;
+        return;
+      }
+
+      // cannot be tackled with borrowing, try to merge; released pages are given back once unpinned
+      if (father_pos == map_information.root && father.block_size == 1) {
+        if (l_brother_pos != -1) {
+          leaf_block &l_brother = Modify(l_page).leaf;
+          for (int i = 0; i < data.block_size; ++i) {
+            l_brother.SetKey(l_brother.block_size + i, data.Key(i));
+          }
+          l_brother.block_size += data.block_size;
+          l_brother.next_block = data.next_block;
+          map_information.root = l_brother_pos;
+          Free(pos);
+          Free(father_pos);
+        } else {
+          const leaf_block &r_brother = r_page->leaf;
+          for (int i = 0; i < r_brother.block_size; ++i) {
+            data.SetKey(data.block_size + i, r_brother.Key(i));
+          }
+          data.block_size += r_brother.block_size;
+          data.next_block = r_brother.next_block;
+          map_information.root = pos;
+          Free(r_brother_pos);
+          Free(father_pos);
+        }
+        return;
+      }
+      if (l_brother_pos != -1) {
+        leaf_block &l_brother = Modify(l_page).leaf;
+        for (int i = 0; i < data.block_size; ++i) {
+          l_brother.SetKey(l_brother.block_size + i, data.Key(i));
+        }
+        l_brother.block_size += data.block_size;
+        l_brother.next_block = data.next_block;
+        Free(pos);
+        for (int i = target_block_ind; i < father.block_size; ++i) {
+          father.SetKey(i - 1, father.Key(i));
+          father.son_pos[i] = father.son_pos[i + 1];
+        }
+        --father.block_size;
+      } else {
+        const leaf_block &r_brother = r_page->leaf;
+        for (int i = 0; i < r_brother.block_size; ++i) {
+          data.SetKey(data.block_size + i, r_brother.Key(i));
+        }
+        data.block_size += r_brother.block_size;
+        data.next_block = r_brother.next_block;
+        Free(r_brother_pos);
+        for (int i = target_block_ind + 1; i < father.block_size; ++i) {
+          father.SetKey(i - 1, father.Key(i));
+          father.son_pos[i] = father.son_pos[i + 1];
+        }
+        --father.block_size;
+      }
+      leaf.Reset();
+      l_page.Reset();
+      r_page.Reset();
+      MergeInner(std::move(father_page), route, target);
+    }
+
+    // Compressed leaves change by decoding them, editing the entries and encoding them again; a leaf that
+    // no longer fits is cut into as many as needed.
+    void InsertCompressed(const index_value &target) {
+      vector<index_value> entries;
+      if (map_information.root == -1) {
+        entries.push_back(target);
+        leaf_block first;
+        FillLeaf(first, entries, 0, 1);
+        map_information.root = Append(first);
+        map_information.head = map_information.root;
+        map_information.size = 1;
+        return;
+      }
+      vector<path> route;
+      long pos, next_block;
+      {
+        const page leaf = Descend(target, route);
+        pos = leaf.Index();
+        next_block = leaf->leaf.next_block;
+        ReadLeaf(leaf->leaf, entries);
+      }
+      size_t at = 0;
+      while (at < entries.size() && entries[at] < target) {
+        ++at;
+      }
+      if (at < entries.size() && entries[at] == target) {
+        return;
+      }
+      entries.insert(at, target);
+      ++map_information.size;
+      ReplaceChild(route, BuildLeaves(entries, pos, next_block));
+    }
+
+    // A leaf below a quarter of its bytes is merged with a brother if both fit in one page,
+    // otherwise the two share their entries evenly. Taking a value out of a posting list can widen the
+    // gaps of its blocks, so a leaf may also grow; one that no longer fits is cut as InsertCompressed does.
+    void DeleteCompressed(const index_value &target) {
+      vector<path> route;
+      page leaf = Descend(target, route);
+      const long pos = leaf.Index(), next_block = leaf->leaf.next_block;
+      vector<index_value> entries;
+      ReadLeaf(leaf->leaf, entries);
+      size_t at = 0;
+      while (at < entries.size() && entries[at] < target) {
+        ++at;
+      }
+      if (at == entries.size() || entries[at] != target) {
+        return;
+      }
+      entries.erase(at);
+      --map_information.size;
+      if (map_information.size == 0 && route.empty()) {
+        leaf.Reset();
+        Free(pos);
+        map_information.root = -1;
+        map_information.head = -1;
+        return;
+      }
+      const long bytes = EncodedSize(entries);
+      if (bytes > LEAF_BYTES) {
+        leaf.Reset();
+        ReplaceChild(route, BuildLeaves(entries, pos, next_block));
+        return;
+      }
+      if (route.empty() || lazy_delete || bytes >= LEAF_BYTES / 4) {
+        FillLeaf(Modify(leaf).leaf, entries, 0, entries.size());
+        return;
+      }
+      leaf.Reset();
+
+      // the brothers compared are the sons slot and slot + 1 of father
+      page father_page(data_processor, route.back().pos);
+      inner_block &father = Modify(father_page).inner;
+      const long father_pos = route.back().pos;
+      const int slot = route.back().slot > 0 ? route.back().slot - 1 : 0;
+      route.pop_back();
+      const long left_pos = father.son_pos[slot], right_pos = father.son_pos[slot + 1];
+      page left(data_processor, left_pos), right(data_processor, right_pos);
+      vector<index_value> both, other;
+      if (left_pos == pos) {
+        both = entries;
+        ReadLeaf(right->leaf, other);
+      } else {
+        ReadLeaf(left->leaf, both);
+        other = entries;
+      }
+      for (size_t i = 0; i < other.size(); ++i) {
+        both.push_back(other[i]);
+      }
+
+      if (EncodedSize(both) > LEAF_BYTES) { // cut where the first half of the bytes ends
+        const long half = EncodedSize(both) / 2;
+        typename codec::sizer bytes;
+        size_t cut = 0;
+        while (bytes.Bytes() < half) {
+          bytes.Add(both[cut++]);
+        }
+        FillLeaf(Modify(left).leaf, both, 0, cut);
+        FillLeaf(Modify(right).leaf, both, cut, both.size() - cut);
+        father.SetKey(slot, both[cut]);
+        return;
+      }
+
+      leaf_block &merged = Modify(left).leaf;
+      FillLeaf(merged, both, 0, both.size());
+      merged.next_block = right->leaf.next_block;
+      Free(right_pos);
+      for (int i = slot + 1; i < father.block_size; ++i) {
+        father.SetKey(i - 1, father.Key(i));
+        father.son_pos[i] = father.son_pos[i + 1];
+      }
+      --father.block_size;
+      if (father.block_size == 0) { // only the root can run out of separators, the merged leaf replaces it
+        map_information.root = left_pos;
+        Free(father_pos);
+        return;
+      }
+      left.Reset();
+      right.Reset();
+      MergeInner(std::move(father_page), route, target);
+    }
+
+    // The inner block of node lost a son on the way to target. Borrow for it or merge it with a brother,
+    // going up the route as long as the fathers fall below INNER_SIZE / 2 elements.
+    void MergeInner(page node, vector<path> &route, const index_value &target) {
+      while (node->inner.block_size < INNER_SIZE / 2) {
+        if (route.empty()) { // it is allowed to have less than INNER_SIZE / 2 elements in root block
+          return;
+        }
+
+        inner_block &data = Modify(node).inner;
+        const long pos = node.Index();
+        page father_page(data_processor, route.back().pos), l_page, r_page;
+        inner_block &father = Modify(father_page).inner;
+        long father_pos = route.back().pos, l_brother_pos = -1, r_brother_pos = -1;
+        int target_block_ind;
+        route.pop_back();
+        int l = 0, r = father.block_size - 1;
+        while (r - l > 1) {
           const int m = (r + l) >> 1;
-          if (father.r_min[m] <= target) {
+          if (father.Key(m) <= target) {
             l = m;
           } else {
             r = m;
           }
         }
-        if (target < father.r_min[l]) {
+        if (target < father.Key(l)) {
           r_brother_pos = father.son_pos[l + 1];
-          r_brother = data_processor.ReadBlock(r_brother_pos);
+          r_page = page(data_processor, r_brother_pos);
           target_block_ind = 0;
-        } else if (target < father.r_min[r]) {
+        } else if (target < father.Key(r)) {
           l_brother_pos = father.son_pos[l];
           r_brother_pos = father.son_pos[r + 1];
-          l_brother = data_processor.ReadBlock(l_brother_pos);
-          r_brother = data_processor.ReadBlock(r_brother_pos);
+          l_page = page(data_processor, l_brother_pos);
+          r_page = page(data_processor, r_brother_pos);
           target_block_ind = r;
         } else {
           l_brother_pos = father.son_pos[r];
-          l_brother = data_processor.ReadBlock(l_brother_pos);
+          l_page = page(data_processor, l_brother_pos);
           target_block_ind = r + 1;
         }
 
-        // try to borrow an element from l_brother or r_brother
-        if (l_brother_pos != -1 && l_brother.block_size > PAGE_SIZE / 2) {
-          for (int i = data.block_size - 1; i >= 0; --i) {
-            data.r_min[i + 1] = data.r_min[i];
-          }
-          data.r_min[0] = l_brother.r_min[l_brother.block_size - 1];
-          ++data.block_size;
-          data_processor.WriteBack(data, pos);
-          father.r_min[target_block_ind - 1] = data.r_min[0];
-          data_processor.WriteBack(father, father_pos);
-          --l_brother.block_size;
-          data_processor.WriteBack(l_brother, l_brother_pos);
+        // try to borrow an element from l_brother or r_brother
+        if (l_brother_pos != -1 && l_page->inner.block_size > INNER_SIZE / 2) {
+          inner_block &l_brother = Modify(l_page).inner;
+          for (int i = data.block_size - 1; i >= 0; --i) {
+            data.SetKey(i + 1, data.Key(i));
+            data.son_pos[i + 2] = data.son_pos[i + 1];
+          }
+          data.SetKey(0, father.Key(target_block_ind - 1));
+          data.son_pos[1] = data.son_pos[0];
+          data.son_pos[0] = l_brother.son_pos[l_brother.block_size];
+          ++data.block_size;
+          father.SetKey(target_block_ind - 1, l_brother.Key(l_brother.block_size - 1));
+          --l_brother.block_size;
+          return;
+        }
+        if (r_brother_pos != -1 && r_page->inner.block_size > INNER_SIZE / 2) {
+          inner_block &r_brother = Modify(r_page).inner;
+          data.SetKey(data.block_size, father.Key(target_block_ind));
+          data.son_pos[data.block_size + 1] = r_brother.son_pos[0];
+          ++data.block_size;
+          father.SetKey(target_block_ind, r_brother.Key(0));
+          for (int i = 1; i < r_brother.block_size; ++i) {
+            r_brother.SetKey(i - 1, r_brother.Key(i));
+            r_brother.son_pos[i - 1] = r_brother.son_pos[i];
+          }
+          r_brother.son_pos[r_brother.block_size - 1] = r_brother.son_pos[r_brother.block_size];
+          --r_brother.block_size;
+          return;
+        }
+
+        // cannot be tackled with borrowing, try to merge
+        if (father_pos == map_information.root && father.block_size == 1) {
+          if (l_brother_pos != -1) {
+            inner_block &l_brother = Modify(l_page).inner;
+            l_brother.SetKey(l_brother.block_size, father.Key(0));
+            for (int i = 0; i < data.block_size; ++i) {
+              l_brother.son_pos[l_brother.block_size + 1 + i] = data.son_pos[i];
+              l_brother.SetKey(l_brother.block_size + 1 + i, data.Key(i));
+            }
+            l_brother.son_pos[l_brother.block_size + data.block_size + 1] = data.son_pos[data.block_size];
+            l_brother.block_size += (1 + data.block_size);
+            map_information.root = l_brother_pos;
+            Free(pos);
+            Free(father_pos);
+          } else {
+            const inner_block &r_brother = r_page->inner;
+            data.SetKey(data.block_size, father.Key(0));
+            for (int i = 0; i < r_brother.block_size; ++i) {
+              data.son_pos[data.block_size + 1 + i] = r_brother.son_pos[i];
+              data.SetKey(data.block_size + 1 + i, r_brother.Key(i));
+            }
+            data.son_pos[data.block_size + r_brother.block_size + 1] = r_brother.son_pos[r_brother.block_size];
+            data.block_size += (1 + r_brother.block_size);
+            map_information.root = pos;
+            Free(r_brother_pos);
+            Free(father_pos);
+          }
+          return;
+        }
+        if (l_brother_pos != -1) {
+          inner_block &l_brother = Modify(l_page).inner;
+          l_brother.SetKey(l_brother.block_size, father.Key(target_block_ind - 1));
+          for (int i = 0; i < data.block_size; ++i) {
+            l_brother.son_pos[l_brother.block_size + 1 + i] = data.son_pos[i];
+            l_brother.SetKey(l_brother.block_size + 1 + i, data.Key(i));
+          }
+          l_brother.son_pos[l_brother.block_size + data.block_size + 1] = data.son_pos[data.block_size];
+          l_brother.block_size += (1 + data.block_size);
+          Free(pos);
+          for (int i = target_block_ind; i < father.block_size; ++i) {
+            father.SetKey(i - 1, father.Key(i));
+            father.son_pos[i] = father.son_pos[i + 1];
+          }
+          --father.block_size;
+        } else {
+          const inner_block &r_brother = r_page->inner;
+          data.SetKey(data.block_size, father.Key(target_block_ind));
+          for (int i = 0; i < r_brother.block_size; ++i) {
+            data.son_pos[data.block_size + 1 + i] = r_brother.son_pos[i];
+            data.SetKey(data.block_size + 1 + i, r_brother.Key(i));
+          }
+          data.son_pos[data.block_size + r_brother.block_size + 1] = r_brother.son_pos[r_brother.block_size];
+          data.block_size += (1 + r_brother.block_size);
+          Free(r_brother_pos);
+          for (int i = target_block_ind + 1; i < father.block_size; ++i) {
+            father.SetKey(i - 1, father.Key(i));
+            father.son_pos[i] = father.son_pos[i + 1];
+          }
+          --father.block_size;
+        }
+        node = std::move(father_page); // the father lost a son in turn
+      }
+    }
+
+    // Every page of the subtree at pos goes to pages, and the inner blocks right above the leaves to fathers
+    // in key order.
+    void CollectPages(const long pos, vector<long> &pages, vector<long> &fathers) {
+      pages.push_back(pos);
+      vector<long> sons;
+      {
+        const page node(data_processor, pos);
+        if (node->inner.type == LEAF_PAGE) {
+          return;
+        }
+        for (int i = 0; i <= node->inner.block_size; ++i) {
+          sons.push_back(node->inner.son_pos[i]);
+        }
+      }
+      if (page(data_processor, sons[0])->leaf.type == LEAF_PAGE) {
+        fathers.push_back(pos);
+        for (size_t i = 0; i < sons.size(); ++i) {
+          pages.push_back(sons[i]);
+        }
+        return;
+      }
+      for (size_t i = 0; i < sons.size(); ++i) {
+        CollectPages(sons[i], pages, fathers);
+      }
+    }
+
+    bool Sparse(const leaf_block &leaf) const {
+      return map_information.compressed ? leaf.bytes < LEAF_BYTES / 4 : leaf.block_size < LEAF_SIZE / 2;
+    }
+
+    // whether the entries of two neighbouring leaves fit in one
+    bool Fits(const vector<index_value> &left, const vector<index_value> &right) const {
+      if (!map_information.compressed) {
+        return left.size() + right.size() < LEAF_SIZE;
+      }
+      typename codec::sizer bytes;
+      for (size_t i = 0; i < left.size(); ++i) {
+        bytes.Add(left[i]);
+      }
+      for (size_t i = 0; i < right.size(); ++i) {
+        bytes.Add(right[i]);
+      }
+      return bytes.Bytes() <= LEAF_BYTES;
+    }
+
+    // make the inner block of node have sons, whose first key only matters as the separator in front of it
+    void SetSons(page &node, const vector<child> &sons) {
+      inner_block &father = Modify(node).inner;
+      father.block_size = sons.size() - 1;
+      father.son_pos[0] = sons[0].pos;
+      for (size_t i = 1; i < sons.size(); ++i) {
+        father.SetKey(i - 1, sons[i].key);
+        father.son_pos[i] = sons[i].pos;
+      }
+    }
+
+    // Merge runs of the leaves under the father at pos as Compact describes; each run goes to the page of its
+    // first leaf, the others are given back and the father keeps one son per run.
+    // With the log on, a father with many sparse sons could dirty more pages than the cache holds, so a run
+    // takes at most a quarter of the cache, and when a checkpoint is due the father is first rewritten with
+    // the runs merged so far followed by the sons not reached yet.
+    void CompactFather(const long pos) {
+      page node(data_processor, pos);
+      const int count = node->inner.block_size + 1;
+      vector<child> original;
+      for (int i = 0; i < count; ++i) {
+        original.push_back({i == 0 ? node->inner.Key(0) : node->inner.Key(i - 1), node->inner.son_pos[i]});
+      }
+      size_t longest = count; // leaves in one run
+      if constexpr (LOGGABLE) {
+        if (log.Enabled()) {
+          longest = std::max<long>(data_processor.Capacity() / 4, 2);
+        }
+      }
+      vector<child> sons; // the runs already merged
+      vector<long> run;
+      vector<index_value> entries, stored;
+      index_value key; // the separator in front of the run
+      long next_block = -1; // of the last leaf of the run
+      bool sparse = false; // whether the last leaf of the run is sparse
+      bool changed = false;
+      auto finish = [&]() {
+        if (run.size() > 1) {
+          page first(data_processor, run[0]);
+          leaf_block &leaf = Modify(first).leaf;
+          FillLeaf(leaf, entries, 0, entries.size());
+          leaf.next_block = next_block;
+          for (size_t i = 1; i < run.size(); ++i) {
+            Free(run[i]);
+          }
+          changed = true;
+        }
+        sons.push_back({key, run[0]});
+        run.clear();
+      };
+      for (int i = 0; i < count; ++i) {
+        const long son = original[i].pos;
+        const index_value separator = original[i].key;
+        bool son_sparse;
+        long son_next;
+        {
+          const page leaf(data_processor, son);
+          ReadLeaf(leaf->leaf, stored);
+          son_sparse = Sparse(leaf->leaf);
+          son_next = leaf->leaf.next_block;
+        }
+        // only the root may be left with a single son, any other father keeps its last one apart
+        const bool last_apart = i == count - 1 && sons.empty() && pos != map_information.root;
+        if (!run.empty() && (sparse || son_sparse) && !last_apart && run.size() < longest &&
+            Fits(entries, stored)) {
+          for (size_t j = 0; j < stored.size(); ++j) {
+            entries.push_back(stored[j]);
+          }
+        } else {
+          if (!run.empty()) {
+            finish();
+          }
+          if constexpr (LOGGABLE) {
+            if (changed && CheckpointDue()) {
+              vector<child> now = sons;
+              for (int j = i; j < count; ++j) {
+                now.push_back(original[j]);
+              }
+              SetSons(node, now);
+              node.Reset();
+              Checkpoint();
+              node = page(data_processor, pos);
+            }
+          }
+          key = separator;
+          entries = stored;
+        }
+        run.push_back(son);
+        next_block = son_next;
+        sparse = son_sparse;
+      }
+      finish();
+      if (!changed) {
+        return;
+      }
+      if (sons.size() == 1) { // the leaves of the root became one, which takes its place
+        node.Reset();
+        map_information.root = sons[0].pos;
+        Free(pos);
+        return;
+      }
+      SetSons(node, sons);
+    }
+
+    // whether updates go to the buffer of the root, which takes a root that is an inner block
+    bool Buffering() {
+      return map_information.buffered && map_information.root != -1 &&
+             page(data_processor, map_information.root)->inner.type == INNER_PAGE;
+    }
+
+    static int BufferCount(const inner_block &node) {
+      return node.son_pos[BUFFERED_FANOUT];
+    }
+
+    // the first message whose index is not below index
+    static int BufferRank(const inner_block &node, const key_type &index) {
+      int l = 0, r = BufferCount(node);
+      while (l < r) {
+        const int m = (l + r) >> 1;
+        if (node.Index(BUFFERED_FANOUT + m) < index) {
+          l = m + 1;
+        } else {
+          r = m;
+        }
+      }
+      return l;
+    }
+
+    static void LoadBuffer(const inner_block &node, vector<message> &messages) {
+      messages.clear();
+      for (int j = 0; j < BufferCount(node); ++j) {
+        messages.push_back({node.Key(BUFFERED_FANOUT + j), node.son_pos[BUFFERED_FANOUT + 1 + j]});
+      }
+    }
+
+    // make the buffer of node hold messages[begin, begin + n), which must fit
+    static void SaveBuffer(inner_block &node, const vector<message> &messages, const long begin, const long n) {
+      node.son_pos[BUFFERED_FANOUT] = n;
+      for (long j = 0; j < n; ++j) {
+        node.SetKey(BUFFERED_FANOUT + j, messages[begin + j].entry);
+        node.son_pos[BUFFERED_FANOUT + 1 + j] = messages[begin + j].insert;
+      }
+    }
+
+    // A block that held messages was rebuilt as blocks by BuildLevel, give each of them its share.
+    void SpreadBuffer(const vector<child> &blocks, const vector<message> &messages) {
+      size_t begin = 0;
+      for (size_t j = 0; j < blocks.size() && begin < messages.size(); ++j) {
+        size_t end = begin;
+        while (end < messages.size() && (j + 1 == blocks.size() || messages[end].entry < blocks[j + 1].key)) {
+          ++end;
+        }
+        if (end > begin) {
+          page node(data_processor, blocks[j].pos);
+          SaveBuffer(Modify(node).inner, messages, begin, end - begin);
+        }
+        begin = end;
+      }
+    }
+
+    // Add an update to the buffer of the root, where it replaces an older message for the same element.
+    void Buffer(const bool insert, const index_value &target) {
+      while (BufferCount(page(data_processor, map_information.root)->inner) == BUFFER_SIZE) {
+        FlushBuffer(vector<path>(), map_information.root);
+      }
+      page root(data_processor, map_information.root);
+      vector<message> messages;
+      LoadBuffer(root->inner, messages);
+      size_t at = 0;
+      while (at < messages.size() && messages[at].entry < target) {
+        ++at;
+      }
+      if (at < messages.size() && messages[at].entry == target) {
+        messages[at].insert = insert;
+      } else {
+        messages.insert(at, {target, insert});
+        ++map_information.messages;
+      }
+      SaveBuffer(Modify(root).inner, messages, 0, messages.size());
+    }
+
+    // Hand the messages of the inner block at pos for the son that has the most of them one level down: into
+    // the buffer of an inner son, or into a leaf son, which splits as needed. An inner son without room for
+    // them flushes its own buffer instead and nothing moves here, so callers flush until they have room.
+    // route leads to pos.
+    void FlushBuffer(const vector<path> &route, const long pos) {
+      vector<message> moved, kept;
+      int slot = 0;
+      long son;
+      {
+        const page node(data_processor, pos);
+        const inner_block &father = node->inner;
+        vector<message> messages;
+        LoadBuffer(father, messages);
+        int run_slot = -1, run = 0, most = 0;
+        for (size_t j = 0; j < messages.size(); ++j) {
+          const int to = father.UpperBound(messages[j].entry);
+          run = to == run_slot ? run + 1 : 1;
+          run_slot = to;
+          if (run > most) {
+            most = run;
+            slot = to;
+          }
+        }
+        for (size_t j = 0; j < messages.size(); ++j) {
+          (father.UpperBound(messages[j].entry) == slot ? moved : kept).push_back(messages[j]);
+        }
+        son = father.son_pos[slot];
+      }
+      vector<path> below = route;
+      below.push_back({pos, slot});
+      page target(data_processor, son);
+      if (target->inner.type == INNER_PAGE) {
+        vector<message> waiting, merged;
+        LoadBuffer(target->inner, waiting);
+        if (waiting.size() + moved.size() > BUFFER_SIZE) {
+          target.Reset();
+          FlushBuffer(below, son);
+          return;
+        }
+        size_t l = 0;
+        for (size_t j = 0; j < moved.size(); ++j) {
+          while (l < waiting.size() && waiting[l].entry < moved[j].entry) {
+            merged.push_back(waiting[l++]);
+          }
+          if (l < waiting.size() && waiting[l].entry == moved[j].entry) { // the newer message wins
+            ++l;
+            --map_information.messages;
+          }
+          merged.push_back(moved[j]);
+        }
+        while (l < waiting.size()) {
+          merged.push_back(waiting[l++]);
+        }
+        SaveBuffer(Modify(target).inner, merged, 0, merged.size());
+        page node(data_processor, pos);
+        SaveBuffer(Modify(node).inner, kept, 0, kept.size());
+        return;
+      }
+
+      vector<index_value> stored, entries;
+      const long next_block = target->leaf.next_block;
+      ReadLeaf(target->leaf, stored);
+      target.Reset();
+      {
+        page node(data_processor, pos);
+        SaveBuffer(Modify(node).inner, kept, 0, kept.size());
+      }
+      map_information.size += MergeMessages(stored, moved, 0, moved.size(), entries);
+      map_information.messages -= moved.size();
+      if (entries.empty()) {
+        leaf_block empty;
+        empty.next_block = next_block;
+        Store(empty, son);
+        return;
+      }
+      ReplaceChild(below, BuildLeaves(entries, son, next_block));
+    }
+
+    // Empty the buffers of the subtree at pos from the top down. Returns false if an inner block split on the
+    // way, since the routes recorded above it no longer hold.
+    bool FlushSubtree(const vector<path> &route, const long pos) {
+      const long splits = inner_splits;
+      vector<long> sons;
+      while (true) {
+        {
+          const page node(data_processor, pos);
+          if (node->inner.type == LEAF_PAGE) {
+            return true;
+          }
+          if (BufferCount(node->inner) == 0) {
+            for (int i = 0; i <= node->inner.block_size; ++i) {
+              sons.push_back(node->inner.son_pos[i]);
+            }
+            break;
+          }
+        }
+        CheckpointIfFull();
+        FlushBuffer(route, pos);
+        if (inner_splits != splits) {
+          return false;
+        }
+      }
+      for (size_t i = 0; i < sons.size(); ++i) {
+        vector<path> below = route;
+        below.push_back({pos, static_cast<int>(i)});
+        if (!FlushSubtree(below, sons[i])) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // merge the memtable, then empty every buffer
+    void FlushAll() {
+      MergeMemtable();
+      while (map_information.messages > 0) {
+        FlushSubtree(vector<path>(), map_information.root);
+      }
+    }
+
+    // The messages for index in the buffers of the subtree at pos, which is depth below the root.
+    void PendingMessages(const long pos, const key_type &index, const int depth, vector<message> &pending) {
+      vector<long> sons;
+      {
+        const page node(data_processor, pos);
+        if (node->inner.type == LEAF_PAGE) {
+          return;
+        }
+        const inner_block &inner = node->inner;
+        for (int j = BufferRank(inner, index); j < BufferCount(inner) && inner.Index(BUFFERED_FANOUT + j) == index; ++j) {
+          pending.push_back({inner.Key(BUFFERED_FANOUT + j), inner.son_pos[BUFFERED_FANOUT + 1 + j], depth});
+        }
+        const int last = inner.template Rank<true>(index);
+        for (int i = inner.Rank(index); i <= last; ++i) {
+          sons.push_back(inner.son_pos[i]);
+        }
+      }
+      for (size_t i = 0; i < sons.size(); ++i) {
+        PendingMessages(sons[i], index, depth + 1, pending);
+      }
+    }
+
+    // Change the sorted values of an index in the leaves by the messages for it. Of several messages for the
+    // same value the one nearest to the root is the newest.
+    static void ApplyMessages(vector<Value> &values, vector<message> &pending) {
+      std::sort(&pending[0], &pending[0] + pending.size(), [](const message &a, const message &b) {
+        return a.entry.value < b.entry.value || (a.entry.value == b.entry.value && a.depth < b.depth);
+      });
+      vector<Value> result;
+      size_t i = 0;
+      for (size_t j = 0; j < pending.size(); ++j) {
+        const Value &value = pending[j].entry.value;
+        if (j > 0 && pending[j - 1].entry.value == value) {
+          continue;
+        }
+        while (i < values.size() && values[i] < value) {
+          result.push_back(values[i++]);
+        }
+        if (i < values.size() && values[i] == value) {
+          ++i;
+        }
+        if (pending[j].insert) {
+          result.push_back(value);
+        }
+      }
+      while (i < values.size()) {
+        result.push_back(values[i++]);
+      }
+      values = result;
+    }
+
+    // Pin the leaf in which the elements of an index start, or the one an element belongs to.
+    // The pages are only read on the way, so they are walked pinned in the cache instead of being copied.
+    template <typename Target>
+    page PinLeaf(const Target &target) {
+      page node(data_processor, map_information.root);
+      while (node->inner.type == INNER_PAGE) {
+        int slot;
+        if constexpr (std::is_same_v<Target, key_type>) {
+          slot = node->inner.Rank(target);
+        } else {
+          slot = node->inner.UpperBound(target);
+        }
+        node = page(data_processor, node->inner.son_pos[slot]);
+      }
+      return node;
+    }
+
+    std::shared_mutex &LeafLatch(const long pos) {
+      return leaf_latches[pos % LEAF_LATCHES];
+    }
+
+    // Insert or delete target inside its leaf while other threads work on the rest of the tree. Returns false
+    // without changing anything when the leaf would have to split or merge, or a checkpoint is due; the caller
+    // then takes the whole tree.
+    bool UpdateLeaf(const bool insert, const index_value &target) {
+      bool sync_due = false;
+      {
+        std::shared_lock<std::shared_mutex> lock(tree_latch);
+        if (map_information.root == -1 || map_information.compressed || map_information.buffered ||
+            memtable_entries > 0) {
+          return false;
+        }
+        if constexpr (LOGGABLE) {
+          if (log.Enabled() && data_processor.DirtyPages() * 2 >= data_processor.Capacity()) {
+            return false;
+          }
+        }
+        page leaf = PinLeaf(target);
+        std::unique_lock<std::shared_mutex> leaf_lock(LeafLatch(leaf.Index()));
+        const leaf_block &current = leaf->leaf;
+        const int at = current.LowerBound(target);
+        const bool found = at < current.block_size && current.Key(at) == target;
+        if (insert == found) { // nothing to do
+          return true;
+        }
+        const bool fits = insert ? current.block_size + 1 < LEAF_SIZE
+                                 : current.block_size - 1 >= LEAF_SIZE / 2 || lazy_delete ||
+                                   (leaf.Index() == map_information.root && current.block_size > 1);
+        if (!fits) {
+          return false;
+        }
+        leaf_block &data = Modify(leaf).leaf;
+        {
+          std::lock_guard<std::mutex> guard(update_latch);
+          if constexpr (LOGGABLE) {
+            if (log.Enabled()) {
+              log.Append({insert, target, ++map_information.lsn});
+            }
+          }
+          map_information.size += insert ? 1 : -1;
+          sync_due = SyncDue(1);
+        }
+        if (insert) {
+          filter.Add(target.index);
+          for (int i = data.block_size - 1; i >= at; --i) {
+            data.SetKey(i + 1, data.Key(i));
+          }
+          data.SetKey(at, target);
+          ++data.block_size;
+        } else {
+          for (int i = at + 1; i < data.block_size; ++i) {
+            data.SetKey(i - 1, data.Key(i));
+          }
+          --data.block_size;
+        }
+      }
+      if (sync_due) {
+        std::unique_lock<std::shared_mutex> lock(tree_latch);
+        if (SyncDue(0)) {
+          SyncTree();
+        }
+      }
+      return true;
+    }
+
+    // The part of Walk in one leaf: the elements from start on whose index is not below from go to visit.
+    // Returns false once visit has asked to stop.
+    template <typename Visit>
+    static bool WalkLeaf(const leaf_block &data, const bool compressed, const key_type &from, const int start,
+                         vector<index_value> &entries, Visit &visit) {
+      if (compressed) {
+        ReadLeaf(data, entries, true);
+        for (size_t i = 0; i < entries.size(); ++i) {
+          if (entries[i].index >= from && !visit(entries[i])) {
+            return false;
+          }
+        }
+        return true;
+      }
+      for (int i = start; i < data.block_size; ++i) {
+        if (!visit(data.Key(i))) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // A visitor for VisitValues that only adds up how many values it is given. A compressed leaf hands it the
+    // length of each run without decoding the values.
+    struct value_count {
+      long long total = 0;
+
+      bool operator()(const Value *, const int n) {
+        total += n;
+        return true;
+      }
+    };
+
+    // The part of VisitValues in one leaf. Returns whether the values of index may go on in the next leaf.
+    template <typename Visit>
+    static bool LeafValues(const leaf_block &data, const bool compressed, const key_type &index, Visit &visit) {
+      if (compressed) {
+        if constexpr (std::is_same_v<std::remove_cvref_t<Visit>, value_count>) {
+          return codec::Count(LeafBytes(data), data.bytes, index, visit.total);
+        }
+        bool wanted = true;
+        const bool more = codec::Scan(LeafBytes(data), data.bytes, index, [&](const Value *values, const int n) {
+          wanted = wanted && visit(values, n);
+        });
+        return more && wanted;
+      }
+      const int start = data.Rank(index);
+      const int end = data.template Rank<true>(index);
+      return (start == end || visit(data.value + start, end - start)) && end == data.block_size;
+    }
+
+    // Scans read the leaves alone, so in a buffered tree every message goes down to its leaf before one starts,
+    // and the memtable is merged.
+    std::shared_lock<std::shared_mutex> ScanLock() {
+      while (true) {
+        std::shared_lock<std::shared_mutex> lock(tree_latch);
+        if (map_information.messages == 0 && unmerged.Empty()) {
+          return lock;
+        }
+        lock.unlock();
+        std::unique_lock<std::shared_mutex> flush(tree_latch);
+        FlushAll();
+      }
+    }
+
+    // Hand the elements from the first one whose index is not below from to visit in order, until it returns
+    // false or the tree ends. The leaves stay pinned while visit runs, so it must not change the tree.
+    template <typename Visit>
+    void Walk(const key_type &from, Visit &&visit) {
+      if (map_information.root == -1) {
+        return;
+      }
+      page leaf = PinLeaf(from);
+      std::shared_lock<std::shared_mutex> leaf_lock(LeafLatch(leaf.Index()));
+
+      const long hint_step = readahead.Depth() > 1 ? readahead.Depth() / 2 : 1;
+      long hops = 0;
+      vector<index_value> entries;
+      int start = map_information.compressed ? 0 : leaf->leaf.Rank(from);
+      while (true) {
+        if (!WalkLeaf(leaf->leaf, map_information.compressed, from, start, entries, visit)) {
           return;
         }
-        if (r_brother_pos != -1 && r_brother.block_size > PAGE_SIZE / 2) {
-          data.r_min[data.block_size] = r_brother.r_min[0];
-          ++data.block_size;
-          data_processor.WriteBack(data, pos);
-          father.r_min[target_block_ind] = r_brother.r_min[1];
-          data_processor.WriteBack(father, father_pos);
-          for (int i = 1; i < r_brother.block_size; ++i) {
-            r_brother.r_min[i - 1] = r_brother.r_min[i];
-          }
-          --r_brother.block_size;
-          data_processor.WriteBack(r_brother, r_brother_pos);
+        const long next = leaf->leaf.next_block;
+        leaf_lock.unlock();
+        leaf.Reset();
+        if (next == -1) {
           return;
         }
+        leaf = page(data_processor, next);
+        leaf_lock = std::shared_lock<std::shared_mutex>(LeafLatch(next));
+        if (hops++ % hint_step == 0) {
+          readahead.Hint(leaf->leaf.next_block);
+        }
+        start = 0;
+      }
+    }
 
-        // cannot be tackled with borrowing, try to merge
-        if (father_pos == map_information.root && father.block_size == 1) {
-          if (l_brother_pos != -1) {
-            for (int i = 0; i < data.block_size; ++i) {
-              l_brother.r_min[l_brother.block_size + i] = data.r_min[i];
-            }
-            l_brother.block_size += data.block_size;
-            l_brother.next_block = data.next_block;
-            map_information.root = l_brother_pos;
-            data_processor.WriteBack(l_brother, l_brother_pos);
-          } else {
-            for (int i = 0; i < r_brother.block_size; ++i) {
-              data.r_min[data.block_size + i] = r_brother.r_min[i];
-            }
-            data.block_size += r_brother.block_size;
-            data.next_block = r_brother.next_block;
-            map_information.root = pos;
-            data_processor.WriteBack(data, pos);
-          }
-          return;
+    // Hand the values of index to visit(values, n) until it returns false. A plain leaf passes all of its
+    // values of index at once, in place; a compressed one passes them a block at a time as they are decoded.
+    // In a buffered tree the messages for index on the way down change the values first, and so do the updates
+    // for it in the memtable, which are newer than any message; the values are then passed at once.
+    template <typename Visit>
+    void VisitValues(const key_type &index, Visit &&visit) {
+      // empty bpt cannot have target index, neither can one whose filter rules it out
+      if ((map_information.root == -1 && unmerged.Empty()) || !filter.MayContain(index)) {
+        return;
+      }
+      if (map_information.buffered || !unmerged.Empty()) {
+        vector<message> pending;
+        for (long i = unmerged.Seek([&index](const index_value &entry) { return entry.index < index; });
+             i != -1 && unmerged.At(i).index == index; i = unmerged.Next(i)) {
+          pending.push_back({unmerged.At(i), unmerged.Inserts(i), -1});
         }
-        if (l_brother_pos != -1) {
-          for (int i = 0; i < data.block_size; ++i) {
-            l_brother.r_min[l_brother.block_size + i] = data.r_min[i];
-          }
-          l_brother.block_size += data.block_size;
-          l_brother.next_block = data.next_block;
-          data_processor.WriteBack(l_brother, l_brother_pos);
-          for (int i = target_block_ind; i < father.block_size; ++i) {
-            father.r_min[i - 1] = father.r_min[i];
-            father.son_pos[i] = father.son_pos[i + 1];
-          }
-          --father.block_size;
-          data = father;
-          pos = father_pos;
-        } else {
-          for (int i = 0; i < r_brother.block_size; ++i) {
-            data.r_min[data.block_size + i] = r_brother.r_min[i];
+        if (map_information.buffered && map_information.root != -1) {
+          PendingMessages(map_information.root, index, 0, pending);
+        }
+        if (!pending.empty()) {
+          vector<Value> values;
+          if (map_information.root != -1) {
+            LeafRun(index, [&values](const Value *stored, const int n) {
+              for (int i = 0; i < n; ++i) {
+                values.push_back(stored[i]);
+              }
+              return true;
+            });
           }
-          data.block_size += r_brother.block_size;
-          data.next_block = r_brother.next_block;
-          data_processor.WriteBack(data, pos);
-          for (int i = target_block_ind + 1; i < father.block_size; ++i) {
-            father.r_min[i - 1] = father.r_min[i];
-            father.son_pos[i] = father.son_pos[i + 1];
+          ApplyMessages(values, pending);
+          if (!values.empty()) {
+            visit(&values[0], values.size());
           }
-          --father.block_size;
-          data = father;
-          pos = father_pos;
+          return;
+        }
+        if (map_information.root == -1) {
+          return;
         }
-      } else {
-        data_processor.WriteBack(data, pos);
-        return;
       }
+      LeafRun(index, visit);
+    }
+
+    // the values of index in the leaves, for VisitValues
+    template <typename Visit>
+    void LeafRun(const key_type &index, Visit &&visit) {
+      page leaf = PinLeaf(index);
+      std::shared_lock<std::shared_mutex> leaf_lock(LeafLatch(leaf.Index()));
 
-      // merge at the non-leaf node
-      while (data.block_size < PAGE_SIZE / 2) {
-        if (route.empty()) { // it is allowed to have less than PAGE_SIZE / 2 elements in root block
-          data_processor.WriteBack(data, pos);
+      // the values continue along the chain of leaves, keep the next few of them on their way
+      const long hint_step = readahead.Depth() > 1 ? readahead.Depth() / 2 : 1;
+      long hops = 0;
+      while (true) {
+        const bool more = LeafValues(leaf->leaf, map_information.compressed, index, visit);
+        const long next = leaf->leaf.next_block;
+        leaf_lock.unlock();
+        leaf.Reset();
+        if (!more || next == -1) {
           return;
         }
+        leaf = page(data_processor, next);
+        leaf_lock = std::shared_lock<std::shared_mutex>(LeafLatch(next));
+        if (hops++ % hint_step == 0) {
+          readahead.Hint(leaf->leaf.next_block);
+        }
+      }
+    }
 
-        block father = route.back().data, l_brother, r_brother;
-        long father_pos = route.back().pos, l_brother_pos = -1, r_brother_pos = -1;
-        int target_block_ind;
-        route.pop_back();
-        l = 0, r = father.block_size - 1;
-        while (r - l > 1) {
-          const int m = (r + l) >> 1;
-          if (father.r_min[m] <= target) {
-            l = m;
-          } else {
-            r = m;
-          }
+    // page pos as the snapshot of epoch sees it
+    block ReadVersion(const long long epoch, const long pos) {
+      return versions.Read(epoch, pos, [this](const long live) { return data_processor.ReadBlock(live); });
+    }
+
+    // the leaf of the snapshot of epoch in which the elements of index start
+    block VersionLeaf(const long long epoch, const long root, const key_type &index) {
+      block page = ReadVersion(epoch, root);
+      while (page.inner.type == INNER_PAGE) {
+        page = ReadVersion(epoch, page.inner.son_pos[page.inner.Rank(index)]);
+      }
+      return page;
+    }
+
+  public:
+    // A position in the chain of leaves. The leaf under it stays pinned, and the next one is only read when
+    // Next steps past the end of the current one, so the values of an index can be read a few at a time.
+    // A cursor must not outlive its tree. Until it reaches the end it holds the tree shared and its leaf latched,
+    // so other threads keep reading and updating other leaves, but its own thread must not update the tree.
+    class cursor {
+      bpt *tree = nullptr;
+      page leaf; // empty once the cursor is at the end
+      vector<index_value> entries; // a compressed leaf, decoded
+      int slot = 0;
+      bool bounded = false; // set by Seek, the cursor ends with the values of bound
+      key_type bound;
+      long hops = 0;
+      std::shared_lock<std::shared_mutex> tree_lock, leaf_lock;
+
+      friend class bpt;
+
+      explicit cursor(bpt *tree) : tree(tree) {}
+
+      int Count() const {
+        return tree->map_information.compressed ? entries.size() : leaf->leaf.block_size;
+      }
+
+      index_value Current() const {
+        return tree->map_information.compressed ? entries[slot] : leaf->leaf.Key(slot);
+      }
+
+      void Load(const long next) {
+        leaf = page(tree->data_processor, next);
+        leaf_lock = std::shared_lock<std::shared_mutex>(tree->LeafLatch(next));
+        if (tree->map_information.compressed) {
+          tree->ReadLeaf(leaf->leaf, entries);
         }
-        if (target < father.r_min[l]) {
-          r_brother_pos = father.son_pos[l + 1];
-          r_brother = data_processor.ReadBlock(r_brother_pos);
-          target_block_ind = 0;
-        } else if (target < father.r_min[r]) {
-          l_brother_pos = father.son_pos[l];
-          r_brother_pos = father.son_pos[r + 1];
-          l_brother = data_processor.ReadBlock(l_brother_pos);
-          r_brother = data_processor.ReadBlock(r_brother_pos);
-          target_block_ind = r;
-        } else {
-          l_brother_pos = father.son_pos[r];
-          l_brother = data_processor.ReadBlock(l_brother_pos);
-          target_block_ind = r + 1;
+      }
+
+      void Release() {
+        if (!leaf.Empty()) {
+          leaf_lock.unlock();
+          leaf.Reset();
         }
+      }
 
-        // try to borrow an element from l_brother or r_brother
-        if (l_brother_pos != -1 && l_brother.block_size > PAGE_SIZE / 2) {
-          for (int i = data.block_size - 1; i >= 0; --i) {
-            data.r_min[i + 1] = data.r_min[i];
-            data.son_pos[i + 2] = data.son_pos[i + 1];
-          }
-          data.r_min[0] = father.r_min[target_block_ind - 1];
-          data.son_pos[1] = data.son_pos[0];
-          data.son_pos[0] = l_brother.son_pos[l_brother.block_size];
-          ++data.block_size;
-          data_processor.WriteBack(data, pos);
-          father.r_min[target_block_ind - 1] = l_brother.r_min[l_brother.block_size - 1];
-          data_processor.WriteBack(father, father_pos);
-          --l_brother.block_size;
-          data_processor.WriteBack(l_brother, l_brother_pos);
-          return;
+      // at the end, let go of the tree as well
+      void Close() {
+        Release();
+        if (tree_lock.owns_lock()) {
+          tree_lock.unlock();
         }
-        if (r_brother_pos != -1 && r_brother.block_size > PAGE_SIZE / 2) {
-          data.r_min[data.block_size] = father.r_min[target_block_ind];
-          data.son_pos[data.block_size + 1] = r_brother.son_pos[0];
-          ++data.block_size;
-          data_processor.WriteBack(data, pos);
-          father.r_min[target_block_ind] = r_brother.r_min[0];
-          data_processor.WriteBack(father, father_pos);
-          for (int i = 1; i < r_brother.block_size; ++i) {
-            r_brother.r_min[i - 1] = r_brother.r_min[i];
-            r_brother.son_pos[i - 1] = r_brother.son_pos[i];
+      }
+
+      // move on to the next leaf while the slot is past the end of this one, then check the bound
+      void Settle() {
+        const long hint_step = tree->readahead.Depth() > 1 ? tree->readahead.Depth() / 2 : 1;
+        while (!leaf.Empty() && slot >= Count()) {
+          const long next = leaf->leaf.next_block;
+          Release();
+          if (next == -1) {
+            Close();
+            return;
           }
-          r_brother.son_pos[r_brother.block_size - 1] = r_brother.son_pos[r_brother.block_size];
-          --r_brother.block_size;
-          data_processor.WriteBack(r_brother, r_brother_pos);
-          return;
+          Load(next);
+          if (hops++ % hint_step == 0) {
+            tree->readahead.Hint(leaf->leaf.next_block);
+          }
+          slot = 0;
+        }
+        if (!leaf.Empty() && bounded && Current().index != bound) {
+          Close();
         }
+      }
 
-        // cannot be tackled with borrowing, try to merge
-        if (father_pos == map_information.root && father.block_size == 1) {
-          if (l_brother_pos != -1) {
-            l_brother.r_min[l_brother.block_size] = father.r_min[0];
-            for (int i = 0; i < data.block_size; ++i) {
-              l_brother.son_pos[l_brother.block_size + 1 + i] = data.son_pos[i];
-              l_brother.r_min[l_brother.block_size + 1 + i] = data.r_min[i];
-            }
-            l_brother.son_pos[l_brother.block_size + data.block_size + 1] = data.son_pos[data.block_size];
-            l_brother.block_size += (1 + data.block_size);
-            map_information.root = l_brother_pos;
-            data_processor.WriteBack(l_brother, l_brother_pos);
-          } else {
-            data.r_min[data.block_size] = father.r_min[0];
-            for (int i = 0; i < r_brother.block_size; ++i) {
-              data.son_pos[data.block_size + 1 + i] = r_brother.son_pos[i];
-              data.r_min[data.block_size + 1 + i] = r_brother.r_min[i];
-            }
-            data.son_pos[data.block_size + r_brother.block_size + 1] = r_brother.son_pos[r_brother.block_size];
-            data.block_size += (1 + r_brother.block_size);
-            map_information.root = pos;
-            data_processor.WriteBack(data, pos);
-          }
+    public:
+      cursor(const cursor &) = delete;
+      cursor &operator=(const cursor &) = delete;
+
+      cursor(cursor &&other) : tree(other.tree), leaf(std::move(other.leaf)), entries(other.entries),
+                               slot(other.slot), bounded(other.bounded), bound(other.bound), hops(other.hops),
+                               tree_lock(std::move(other.tree_lock)), leaf_lock(std::move(other.leaf_lock)) {}
+
+      cursor &operator=(cursor &&other) {
+        if (this != &other) {
+          Close();
+          tree = other.tree;
+          leaf = std::move(other.leaf);
+          entries = other.entries;
+          slot = other.slot;
+          bounded = other.bounded;
+          bound = other.bound;
+          hops = other.hops;
+          tree_lock = std::move(other.tree_lock);
+          leaf_lock = std::move(other.leaf_lock);
+        }
+        return *this;
+      }
+
+      ~cursor() {
+        Close();
+      }
+
+      // go to the first value of index, the cursor ends after its last one
+      void Seek(const std::string &index) {
+        Close();
+        bounded = true;
+        bound = tree->keys.Make(index);
+        hops = 0;
+        tree_lock = tree->ScanLock();
+        if (tree->map_information.root == -1 || !tree->filter.MayContain(bound)) {
+          Close();
           return;
         }
-        if (l_brother_pos != -1) {
-          l_brother.r_min[l_brother.block_size] = father.r_min[target_block_ind - 1];
-          for (int i = 0; i < data.block_size; ++i) {
-            l_brother.son_pos[l_brother.block_size + 1 + i] = data.son_pos[i];
-            l_brother.r_min[l_brother.block_size + 1 + i] = data.r_min[i];
-          }
-          l_brother.son_pos[l_brother.block_size + data.block_size + 1] = data.son_pos[data.block_size];
-          l_brother.block_size += (1 + data.block_size);
-          data_processor.WriteBack(l_brother, l_brother_pos);
-          for (int i = target_block_ind; i < father.block_size; ++i) {
-            father.r_min[i - 1] = father.r_min[i];
-            father.son_pos[i] = father.son_pos[i + 1];
+        leaf = tree->PinLeaf(bound);
+        leaf_lock = std::shared_lock<std::shared_mutex>(tree->LeafLatch(leaf.Index()));
+        if (tree->map_information.compressed) {
+          tree->ReadLeaf(leaf->leaf, entries);
+          slot = 0;
+          while (slot < entries.size() && entries[slot].index < bound) {
+            ++slot;
           }
-          --father.block_size;
-          data = father;
-          pos = father_pos;
         } else {
-          data.r_min[data.block_size] = father.r_min[target_block_ind];
-          for (int i = 0; i < r_brother.block_size; ++i) {
-            data.son_pos[data.block_size + 1 + i] = r_brother.son_pos[i];
-            data.r_min[data.block_size + 1 + i] = r_brother.r_min[i];
-          }
-          data.son_pos[data.block_size + r_brother.block_size + 1] = r_brother.son_pos[r_brother.block_size];
-          data.block_size += (1 + r_brother.block_size);
-          data_processor.WriteBack(data, pos);
-          for (int i = target_block_ind + 1; i < father.block_size; ++i) {
-            father.r_min[i - 1] = father.r_min[i];
-            father.son_pos[i] = father.son_pos[i + 1];
-          }
-          --father.block_size;
-          data = father;
-          pos = father_pos;
+          slot = leaf->leaf.Rank(bound);
+        }
+        Settle();
+      }
+
+      // go to the smallest element of the tree, the cursor then runs over all of them
+      void SeekFirst() {
+        Close();
+        bounded = false;
+        hops = 0;
+        tree_lock = tree->ScanLock();
+        if (tree->map_information.head == -1) {
+          Close();
+          return;
         }
+        Load(tree->map_information.head);
+        slot = 0;
+        Settle();
+      }
+
+      void Next() {
+        ++slot;
+        Settle();
+      }
+
+      bool End() const {
+        return leaf.Empty();
+      }
+
+      Value GetValue() const {
+        return tree->map_information.compressed ? entries[slot].value : leaf->leaf.value[slot];
+      }
+
+      // the index under the cursor, only for trees whose Keys keep the strings
+      std::string GetIndex() const {
+        static_assert(Keys::ORDERED, "GetIndex needs keys that keep the strings");
+        return Keys::Text(Current().index);
       }
+    };
 
-      // this block has valid size, simply write back
-      data_processor.WriteBack(data, pos);
+    // a cursor at the end, Seek or SeekFirst positions it
+    cursor Cursor() {
+      return cursor(this);
     }
 
     vector<Value> Find(const std::string &index) {
-      const hash_pair ind = db_hash(index);
       vector<Value> ans;
+      Find(index, [&ans](const Value &value) { ans.push_back(value); });
+      return ans;
+    }
 
-      // empty bpt cannot have target index
-      if (map_information.root == -1) {
-        return ans;
-      }
-
-      block data = data_processor.ReadBlock(map_information.root);
-      while (data.son_pos[0] != -1) {
-        int l = 0, r = data.block_size - 1;
-        while (r - l > 1) {
-          const int m = (r + l) >> 1;
-          if (data.r_min[m].index < ind) {
-            l = m;
+    // Hand the values of index to visit in order without collecting them; visit may return false to stop.
+    // The leaves stay pinned while visit runs, so it must not change the tree.
+    template <typename Visit> requires std::invocable<Visit &, const Value &>
+    void Find(const std::string &index, Visit &&visit) {
+      std::shared_lock<std::shared_mutex> lock(tree_latch);
+      VisitValues(keys.Make(index), [&visit](const Value *values, const int n) {
+        for (int i = 0; i < n; ++i) {
+          if constexpr (std::is_same_v<std::invoke_result_t<Visit &, const Value &>, bool>) {
+            if (!visit(values[i])) {
+              return false;
+            }
           } else {
-            r = m;
+            visit(values[i]);
           }
         }
-        if (ind <= data.r_min[l].index) {
-          data = data_processor.ReadBlock(data.son_pos[l]);
-        } else if (ind <= data.r_min[r].index) {
-          data = data_processor.ReadBlock(data.son_pos[r]);
-        } else {
-          data = data_processor.ReadBlock(data.son_pos[r + 1]);
+        return true;
+      });
+    }
+
+    // write the values of index to out and return the iterator past the last one
+    template <std::output_iterator<const Value &> Out>
+    Out Find(const std::string &index, Out out) {
+      Find(index, [&out](const Value &value) { *out++ = value; });
+      return out;
+    }
+
+    // number of values of index, counted without reading them out of plain leaves or decoding compressed ones
+    long long Count(const std::string &index) {
+      std::shared_lock<std::shared_mutex> lock(tree_latch);
+      value_count count;
+      VisitValues(keys.Make(index), count);
+      return count.total;
+    }
+
+    // Hand every pair whose index starts with prefix to visit(index, value), ordered by index and then value.
+    // Only for trees whose Keys keep the strings, such as string_index.
+    template <typename Visit>
+    void PrefixScan(const std::string &prefix, Visit &&visit) {
+      static_assert(Keys::ORDERED, "PrefixScan needs keys in string order");
+      std::shared_lock<std::shared_mutex> lock = ScanLock();
+      const key_type last = Keys::Last(prefix);
+      Walk(keys.Make(prefix), [&](const index_value &entry) {
+        if (entry.index > last) {
+          return false;
+        }
+        visit(Keys::Text(entry.index), entry.value);
+        return true;
+      });
+    }
+
+    // The smallest pair whose index is not below index goes to found and value; false if there is none.
+    bool LowerBound(const std::string &index, std::string &found, Value &value) {
+      static_assert(Keys::ORDERED, "LowerBound needs keys in string order");
+      std::shared_lock<std::shared_mutex> lock = ScanLock();
+      bool any = false;
+      Walk(keys.Make(index), [&](const index_value &entry) {
+        found = Keys::Text(entry.index);
+        value = entry.value;
+        any = true;
+        return false;
+      });
+      return any;
+    }
+
+    // The tree as it was when Snapshot() returned it, for reading only. It takes no latch of the tree, so a long
+    // scan runs alongside Insert and Delete: while a snapshot is open, a page that is about to change is copied
+    // aside first and the snapshot reads the copy. The copies are released once no open snapshot reads them.
+    // Unlike the tree, a snapshot does not consult the filter, which only describes the tree as it is now.
+    // A snapshot must not outlive its tree; Close lets go of its copies early.
+    class snapshot {
+      bpt *tree = nullptr;
+      long long epoch = 0;
+      map_info map;
+
+      friend class bpt;
+
+      snapshot(bpt *tree, const long long epoch, const map_info &map) : tree(tree), epoch(epoch), map(map) {}
+
+      template <typename Visit>
+      void Walk(const key_type &from, Visit &&visit) const {
+        if (map.root == -1) {
+          return;
+        }
+        block page = tree->VersionLeaf(epoch, map.root, from);
+        vector<index_value> entries;
+        int start = map.compressed ? 0 : page.leaf.Rank(from);
+        while (WalkLeaf(page.leaf, map.compressed, from, start, entries, visit) && page.leaf.next_block != -1) {
+          page = tree->ReadVersion(epoch, page.leaf.next_block);
+          start = 0;
         }
       }
 
-      // at the leaf block
-      int l = 0, r = data.block_size - 1;
-      while (r - l > 1) {
-        const int m = (r + l) >> 1;
-        if (data.r_min[m].index < ind) {
-          l = m;
-        } else {
-          r = m;
+      template <typename Visit>
+      void VisitValues(const key_type &index, Visit &&visit) const {
+        if (map.root == -1) {
+          return;
+        }
+        block page = tree->VersionLeaf(epoch, map.root, index);
+        while (LeafValues(page.leaf, map.compressed, index, visit) && page.leaf.next_block != -1) {
+          page = tree->ReadVersion(epoch, page.leaf.next_block);
         }
       }
-      if (ind == data.r_min[l].index) {
-        for (int i = l; i < data.block_size; ++i) {
-          if (data.r_min[i].index != ind) {
-            return ans;
-          }
-          ans.push_back(data.r_min[i].value);
+
+    public:
+      snapshot(const snapshot &) = delete;
+      snapshot &operator=(const snapshot &) = delete;
+
+      snapshot(snapshot &&other) : tree(other.tree), epoch(other.epoch), map(other.map) {
+        other.tree = nullptr;
+        other.map = map_info();
+      }
+
+      snapshot &operator=(snapshot &&other) {
+        if (this != &other) {
+          Close();
+          tree = other.tree;
+          epoch = other.epoch;
+          map = other.map;
+          other.tree = nullptr;
+          other.map = map_info();
         }
-        while (data.next_block != -1) {
-          data = data_processor.ReadBlock(data.next_block);
-          for (int i = 0; i < data.block_size; ++i) {
-            if (data.r_min[i].index != ind) {
-              return ans;
-            }
-            ans.push_back(data.r_min[i].value);
-          }
+        return *this;
+      }
+
+      ~snapshot() {
+        Close();
+      }
+
+      // release the copies kept for this snapshot, which reads as an empty tree afterward
+      void Close() {
+        if (tree != nullptr) {
+          tree->versions.Close(epoch);
+          tree = nullptr;
+          map = map_info();
         }
+      }
+
+      long long Size() const {
+        return map.size;
+      }
+
+      vector<Value> Find(const std::string &index) const {
+        vector<Value> ans;
+        Find(index, [&ans](const Value &value) { ans.push_back(value); });
         return ans;
       }
-      if (ind == data.r_min[r].index) {
-        for (int i = r; i < data.block_size; ++i) {
-          if (data.r_min[i].index != ind) {
-            return ans;
-          }
-          ans.push_back(data.r_min[i].value);
+
+      // hand the values of index to visit in order, as bpt::Find does
+      template <typename Visit> requires std::invocable<Visit &, const Value &>
+      void Find(const std::string &index, Visit &&visit) const {
+        if (tree == nullptr) {
+          return;
         }
-        while (data.next_block != -1) {
-          data = data_processor.ReadBlock(data.next_block);
-          for (int i = 0; i < data.block_size; ++i) {
-            if (data.r_min[i].index != ind) {
-              return ans;
+        VisitValues(tree->keys.Make(index), [&visit](const Value *values, const int n) {
+          for (int i = 0; i < n; ++i) {
+            if constexpr (std::is_same_v<std::invoke_result_t<Visit &, const Value &>, bool>) {
+              if (!visit(values[i])) {
+                return false;
+              }
+            } else {
+              visit(values[i]);
             }
-            ans.push_back(data.r_min[i].value);
           }
+          return true;
+        });
+      }
+
+      long long Count(const std::string &index) const {
+        if (tree == nullptr) {
+          return 0;
         }
-        return ans;
+        value_count count;
+        VisitValues(tree->keys.Make(index), count);
+        return count.total;
       }
-      if (ind > data.r_min[r].index) {
-        while (data.next_block != -1) {
-          data = data_processor.ReadBlock(data.next_block);
-          for (int i = 0; i < data.block_size; ++i) {
-            if (data.r_min[i].index != ind) {
-              return ans;
-            }
-            ans.push_back(data.r_min[i].value);
-          }
+
+      // hand every value to visit in the order of the tree, until it returns false
+      template <typename Visit>
+      void ForEach(Visit &&visit) const {
+        Walk(key_type(), [&visit](const index_value &entry) { return visit(entry.value); });
+      }
+
+      // as bpt::PrefixScan
+      template <typename Visit>
+      void PrefixScan(const std::string &prefix, Visit &&visit) const {
+        static_assert(Keys::ORDERED, "PrefixScan needs keys in string order");
+        if (tree == nullptr) {
+          return;
         }
-        return ans;
+        const key_type last = Keys::Last(prefix);
+        Walk(tree->keys.Make(prefix), [&](const index_value &entry) {
+          if (entry.index > last) {
+            return false;
+          }
+          visit(Keys::Text(entry.index), entry.value);
+          return true;
+        });
       }
-      return ans;
+    };
+
+    snapshot Snapshot() {
+      std::unique_lock<std::shared_mutex> lock(tree_latch);
+      FlushAll();
+      return snapshot(this, versions.Open(data_processor.Pages()), map_information);
+    }
+
+    // Keep a Bloom filter of the indexes in the map file name + ".bloom", sized with bits_per_key bits for
+    // expected indexes or the current Size() if that is larger. Find, Count and Seek skip the tree for an
+    // index it rules out. The filter is saved with the map information and rebuilt from the tree if the two
+    // do not match when the tree is opened.
+    void EnableFilter(const int bits_per_key, const long long expected = 0) {
+      std::unique_lock<std::shared_mutex> lock(tree_latch);
+      BuildFilter(bits_per_key, expected);
+    }
+
+    // Deleted indexes stay in the filter and make it less selective; this builds it again from the tree.
+    void RebuildFilter() {
+      std::unique_lock<std::shared_mutex> lock(tree_latch);
+      if (filter.Enabled()) {
+        BuildFilter(filter.BitsPerKey(), 0);
+      }
+    }
+
+    void DisableFilter() {
+      std::unique_lock<std::shared_mutex> lock(tree_latch);
+      filter.Disable();
+    }
+
+    // pages to read ahead along the chain of leaves when Find runs over several of them, 0 disables it
+    void SetReadahead(const int leaves) {
+      readahead.SetDepth(leaves);
+    }
+
+    // Bound the page cache by a number of pages or by its memory footprint. Resizing writes the dirty pages
+    // back, so with the log on a checkpoint comes first, and the cache keeps at least LOG_CACHE_PAGES.
+    void SetCachePages(const long pages) {
+      std::unique_lock<std::shared_mutex> lock(tree_latch);
+      BeforeResize();
+      data_processor.SetCapacity(pages);
+      AfterResize();
+    }
+
+    void SetCacheBytes(const long bytes) {
+      std::unique_lock<std::shared_mutex> lock(tree_latch);
+      BeforeResize();
+      data_processor.SetCapacityBytes(bytes);
+      AfterResize();
     }
 
-    long long Size() const {
+    // the number of entries, after the buffered messages and the memtable have reached the leaves (ScanLock)
+    long long Size() {
+      const std::shared_lock<std::shared_mutex> lock = ScanLock();
+      std::lock_guard<std::mutex> guard(update_latch);
       return map_information.size;
     }
   };
@@ -0,0 +1,161 @@
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include "exceptions.hpp"
+#include "write_ahead_log.h"
+
+// Bloom filter over keys (anything with a word[] array), kept in a file of its own. A key that was never added
+// is reported absent except for a false positive rate of about 0.62^bits_per_key. Keys cannot be taken out
+// again, so after many deletes the filter should be built anew with Reset.
+// Every Save stamps the file with a generation, which lets the owner tell whether it belongs to its own state.
+// Add and MayContain may run in several threads at once, the other calls need the filter to themselves.
+template <typename Key>
+class bloom_filter {
+
+  struct header {
+    unsigned long long magic = LOG_MAGIC;
+    long long generation = 0;
+    long words = 0;
+    int hashes = 0;
+    int bits_per_key = 0;
+  };
+
+  std::string file_name;
+  header info;
+  unsigned long long *bits = nullptr; // info.words of them, null while there is no filter
+  std::atomic<bool> dirty = false;
+
+  static unsigned long long Mix(unsigned long long x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+  }
+
+  // the probes of key are first + i * step for i < hashes
+  static void Hash(const Key &key, unsigned long long &first, unsigned long long &step) {
+    first = 0x9e3779b97f4a7c15ull;
+    step = 0;
+    for (const unsigned long long word : key.word) {
+      first = Mix(first ^ word);
+      step += first;
+    }
+    step = Mix(step) | 1;
+  }
+
+public:
+  explicit bloom_filter(const std::string &file_name) : file_name(file_name) {
+    const int fd = open(file_name.c_str(), O_RDONLY);
+    if (fd == -1) {
+      return;
+    }
+    header saved;
+    if (ReadFully(fd, &saved, sizeof(saved)) && saved.magic == LOG_MAGIC && saved.words > 0) {
+      bits = new unsigned long long[saved.words];
+      if (ReadFully(fd, bits, saved.words * sizeof(unsigned long long))) {
+        info = saved;
+      } else {
+        delete[] bits;
+        bits = nullptr;
+      }
+    }
+    close(fd);
+  }
+
+  ~bloom_filter() {
+    delete[] bits;
+  }
+
+  bloom_filter(const bloom_filter &) = delete;
+  bloom_filter &operator=(const bloom_filter &) = delete;
+
+  bool Enabled() const {
+    return bits != nullptr;
+  }
+
+  bool Dirty() const {
+    return dirty;
+  }
+
+  long long Generation() const {
+    return info.generation;
+  }
+
+  int BitsPerKey() const {
+    return info.bits_per_key;
+  }
+
+  // start over with an empty filter sized for keys keys
+  void Reset(const int bits_per_key, const long long keys) {
+    delete[] bits;
+    info.bits_per_key = bits_per_key;
+    info.hashes = std::max(1, std::min(16, static_cast<int>(bits_per_key * 0.69 + 0.5)));
+    info.words = std::max(1ll, (keys * bits_per_key + 63) / 64);
+    bits = new unsigned long long[info.words]();
+    dirty = true;
+  }
+
+  void Add(const Key &key) {
+    if (bits == nullptr) {
+      return;
+    }
+    unsigned long long probe, step;
+    Hash(key, probe, step);
+    const unsigned long long total = info.words * 64ull;
+    for (int i = 0; i < info.hashes; ++i, probe += step) {
+      const unsigned long long bit = probe % total;
+      std::atomic_ref<unsigned long long>(bits[bit / 64]).fetch_or(1ull << bit % 64, std::memory_order_relaxed);
+    }
+    dirty = true;
+  }
+
+  // false only if key was never added; always true without a filter
+  bool MayContain(const Key &key) const {
+    if (bits == nullptr) {
+      return true;
+    }
+    unsigned long long probe, step;
+    Hash(key, probe, step);
+    const unsigned long long total = info.words * 64ull;
+    for (int i = 0; i < info.hashes; ++i, probe += step) {
+      const unsigned long long bit = probe % total;
+      if ((std::atomic_ref<unsigned long long>(bits[bit / 64]).load(std::memory_order_relaxed) >> bit % 64 & 1) == 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // write the filter to its file under generation and make it durable
+  void Save(const long long generation) {
+    info.generation = generation;
+    const int fd = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+      throw sjtu::runtime_error();
+    }
+    WriteFully(fd, &info, sizeof(info));
+    WriteFully(fd, bits, info.words * sizeof(unsigned long long));
+    fdatasync(fd);
+    close(fd);
+    dirty = false;
+  }
+
+  // drop the filter and its file
+  void Disable() {
+    delete[] bits;
+    bits = nullptr;
+    info = header();
+    dirty = false;
+    unlink(file_name.c_str());
+  }
+};
+
+#endif //BLOOM_FILTER_H
@@ -1,17 +1,273 @@
 #ifndef FILE_PROCESSOR_H
 #define FILE_PROCESSOR_H
 
+#include <cstring>
 #include <fstream>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include "exceptions.hpp"
 
-constexpr long FILE_UNIT_SIZE = 4096;
+constexpr long FILE_UNIT_SIZE = 4096; // default page size
+constexpr long DEFAULT_CACHE_PAGES = 1024;
 
-template <typename Block>
+// kept in page 0 of every data file, blocks start at page 1
+struct storage_header {
+  long free_head = -1; // last released page, each released page stores the previous one in its first bytes
+  long page_size = 0; // page size the file was created with, 0 in files older than this field, which are not opened
+
+  // whether a file with this header can be opened with pages of page_bytes
+  bool Accepts(const long page_bytes) const {
+    return page_size == page_bytes;
+  }
+};
+
+// force what the system holds for file_name to stable storage
+inline void SyncPath(const std::string &file_name) {
+  const int fd = open(file_name.c_str(), O_RDONLY);
+  if (fd != -1) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+// A page kept pinned in a storage (file_processor or mmap_file_processor) for as long as the handle holds it.
+// The block is read in place; Edit gives write access and has the page written back when the handle lets go.
+template <typename Storage, typename Block>
+class page_handle {
+  Storage *storage = nullptr;
+  long index = -1;
+  Block *block = nullptr;
+  bool dirty = false;
+
+public:
+  page_handle() = default;
+
+  page_handle(Storage &storage, const long index) : storage(&storage), index(index), block(&storage.Pin(index)) {}
+
+  page_handle(const page_handle &) = delete;
+  page_handle &operator=(const page_handle &) = delete;
+
+  page_handle(page_handle &&other) : storage(other.storage), index(other.index), block(other.block), dirty(other.dirty) {
+    other.storage = nullptr;
+  }
+
+  page_handle &operator=(page_handle &&other) {
+    if (this != &other) {
+      Reset();
+      storage = other.storage;
+      index = other.index;
+      block = other.block;
+      dirty = other.dirty;
+      other.storage = nullptr;
+    }
+    return *this;
+  }
+
+  ~page_handle() {
+    Reset();
+  }
+
+  // unpin the page, the handle holds none afterward
+  void Reset() {
+    if (storage != nullptr) {
+      storage->Unpin(index, dirty);
+      storage = nullptr;
+    }
+  }
+
+  bool Empty() const {
+    return storage == nullptr;
+  }
+
+  long Index() const {
+    return index;
+  }
+
+  const Block &operator*() const {
+    return *block;
+  }
+
+  const Block *operator->() const {
+    return block;
+  }
+
+  Block &Edit() {
+    dirty = true;
+    return *block;
+  }
+};
+
+template <typename Block, long PageBytes = FILE_UNIT_SIZE>
 class file_processor {
+  static_assert(sizeof(Block) <= PageBytes && sizeof(storage_header) <= PageBytes, "a block must fit in one page");
+
+  // a cached page, linked into the LRU list and into one hash bucket
+  struct frame {
+    Block block;
+    long index = -1;
+    int pin_count = 0;
+    bool dirty = false;
+    long prev = -1, next = -1;
+    long bucket_next = -1;
+  };
 
   std::fstream file;
+  std::string file_name;
+  storage_header header;
+  long block_count = 0; // pages owned by the file, including those only present in the cache
+
+  frame *frames = nullptr;
+  long *buckets = nullptr;
+  long capacity = 0, used = 0, bucket_mask = 0;
+  long lru_head = -1, lru_tail = -1; // head is the most recently used frame
+  long dirty_count = 0;
+  bool no_steal = false; // dirty pages stay in the cache until Flush
+  // Taken by every call that reaches the frames, the header or the stream. Snapshot readers fetch pages
+  // without any latch of the tree, so even the calls that change the whole cache (Flush, SetCapacity) may run
+  // while other threads read.
+  mutable std::mutex latch;
+
+  long FindFrame(const long index) const {
+    for (long f = buckets[index & bucket_mask]; f != -1; f = frames[f].bucket_next) {
+      if (frames[f].index == index) {
+        return f;
+      }
+    }
+    return -1;
+  }
+
+  void Detach(const long f) {
+    if (frames[f].prev != -1) {
+      frames[frames[f].prev].next = frames[f].next;
+    } else {
+      lru_head = frames[f].next;
+    }
+    if (frames[f].next != -1) {
+      frames[frames[f].next].prev = frames[f].prev;
+    } else {
+      lru_tail = frames[f].prev;
+    }
+    frames[f].prev = frames[f].next = -1;
+  }
+
+  void Touch(const long f) {
+    if (lru_head == f) {
+      return;
+    }
+    if (frames[f].prev != -1) {
+      Detach(f);
+    }
+    frames[f].next = lru_head;
+    if (lru_head != -1) {
+      frames[lru_head].prev = f;
+    }
+    lru_head = f;
+    if (lru_tail == -1) {
+      lru_tail = f;
+    }
+  }
+
+  void Unhash(const long f) {
+    long *link = &buckets[frames[f].index & bucket_mask];
+    while (*link != f) {
+      link = &frames[*link].bucket_next;
+    }
+    *link = frames[f].bucket_next;
+    frames[f].bucket_next = -1;
+  }
+
+  void WriteFrame(frame &f) {
+    file.seekp(f.index * PageBytes);
+    file.write(reinterpret_cast<char *>(&f.block), sizeof(f.block));
+    f.dirty = false;
+    --dirty_count;
+  }
+
+  void MarkDirty(frame &f) {
+    if (!f.dirty) {
+      f.dirty = true;
+      ++dirty_count;
+    }
+  }
+
+  // take a free frame, or the least recently used unpinned one after writing it back
+  long Victim() {
+    if (used < capacity) {
+      return used++;
+    }
+    for (long f = lru_tail; f != -1; f = frames[f].prev) {
+      if (frames[f].pin_count == 0 && !(no_steal && frames[f].dirty)) {
+        if (frames[f].dirty) {
+          WriteFrame(frames[f]);
+        }
+        Unhash(f);
+        Detach(f);
+        return f;
+      }
+    }
+    throw sjtu::runtime_error(); // every frame is pinned, or dirty while stealing is off
+  }
+
+  // return the frame holding page index, loading it from the file if load is set
+  long Fetch(const long index, const bool load) {
+    long f = FindFrame(index);
+    if (f == -1) {
+      f = Victim();
+      frames[f].index = index;
+      frames[f].pin_count = 0;
+      frames[f].dirty = false;
+      frames[f].bucket_next = buckets[index & bucket_mask];
+      buckets[index & bucket_mask] = f;
+      if (load) {
+        file.seekg(index * PageBytes);
+        file.read(reinterpret_cast<char *>(&frames[f].block), sizeof(Block));
+      }
+    }
+    Touch(f);
+    return f;
+  }
+
+  void Allocate(const long pages) {
+    capacity = pages < 1 ? 1 : pages;
+    long bucket_count = 1;
+    while (bucket_count < capacity * 2) {
+      bucket_count <<= 1;
+    }
+    bucket_mask = bucket_count - 1;
+    frames = new frame[capacity];
+    buckets = new long[bucket_count];
+    for (long i = 0; i < bucket_count; ++i) {
+      buckets[i] = -1;
+    }
+    used = 0;
+    lru_head = lru_tail = -1;
+    dirty_count = 0;
+  }
+
+  // write every dirty page and the header back to the file, latch held
+  void WriteAll() {
+    for (long f = 0; f < used; ++f) {
+      if (frames[f].dirty) {
+        WriteFrame(frames[f]);
+      }
+    }
+    file.seekp(0);
+    file.write(reinterpret_cast<char *>(&header), sizeof(header));
+    file.flush();
+  }
+
+  void Release() {
+    WriteAll();
+    delete[] frames;
+    delete[] buckets;
+    frames = nullptr;
+    buckets = nullptr;
+  }
 
 public:
-  explicit file_processor(const std::string &file_name) {
+  explicit file_processor(const std::string &file_name, const long cache_pages = DEFAULT_CACHE_PAGES) :
+      file_name(file_name) {
     bool file_exist = false;
     file.open(file_name);
     if (file.is_open()) {
@@ -22,39 +278,174 @@ public:
       std::ofstream new_file(file_name);
       new_file.close();
     }
+    file.rdbuf()->pubsetbuf(nullptr, 0); // pages are buffered by the cache, not by the stream
     file.open(file_name);
+
+    file.seekg(0, std::ios::end);
+    const long end = file.tellg();
+    if (end == 0) {
+      header.page_size = PageBytes;
+      file.seekp(0);
+      file.write(reinterpret_cast<char *>(&header), sizeof(header));
+      block_count = 1;
+    } else {
+      file.seekg(0);
+      file.read(reinterpret_cast<char *>(&header), sizeof(header));
+      if (!header.Accepts(PageBytes)) {
+        throw sjtu::runtime_error(); // the file was created with another page size
+      }
+      block_count = (end + PageBytes - 1) / PageBytes;
+    }
+    Allocate(cache_pages);
   }
 
   ~file_processor() {
+    Release();
     file.close();
   }
 
+  file_processor(const file_processor &) = delete;
+  file_processor &operator=(const file_processor &) = delete;
+
+  // resize the cache; dirty pages are written back and no page may be pinned
+  void SetCapacity(const long pages) {
+    std::lock_guard<std::mutex> lock(latch);
+    Release();
+    Allocate(pages);
+  }
+
+  void SetCapacityBytes(const long bytes) {
+    SetCapacity(bytes / static_cast<long>(sizeof(frame)));
+  }
+
   Block ReadBlock(const int index) {
-    file.seekg(index * FILE_UNIT_SIZE);
-    Block target;
-    file.read(reinterpret_cast<char *>(&target), sizeof(target));
-    return target;
+    std::lock_guard<std::mutex> lock(latch);
+    return frames[Fetch(index, true)].block;
   }
 
+  // store block in a released page if there is one, otherwise append it to the file
   long WriteBlock(Block &block) {
-    file.seekp(0, std::ios::end);
+    std::lock_guard<std::mutex> lock(latch);
     long index;
-    const auto end = file.tellp();
-    if (end % FILE_UNIT_SIZE == 0) {
-      index = end / FILE_UNIT_SIZE;
-    } else {
-      index = end / FILE_UNIT_SIZE + 1;
+    if (header.free_head != -1) {
+      index = header.free_head;
+      frame &f = frames[Fetch(index, true)];
+      std::memcpy(&header.free_head, &f.block, sizeof(long));
+      f.block = block;
+      MarkDirty(f);
+      return index;
     }
-    file.seekp(index * FILE_UNIT_SIZE);
-    file.write(reinterpret_cast<char *>(&block), sizeof(block));
-    file.flush();
+    index = block_count++;
+    frame &f = frames[Fetch(index, false)];
+    f.block = block;
+    MarkDirty(f);
     return index;
   }
 
-  void WriteBack(Block &block, const int index) {
-    file.seekp(index * FILE_UNIT_SIZE);
-    file.write(reinterpret_cast<char *>(&block), sizeof(block));
-    file.flush();
+  // give page index back for reuse by WriteBlock, its content is lost
+  void Release(const long index) {
+    std::lock_guard<std::mutex> lock(latch);
+    frame &f = frames[Fetch(index, false)];
+    std::memcpy(static_cast<void *>(&f.block), &header.free_head, sizeof(long));
+    MarkDirty(f);
+    header.free_head = index;
+  }
+
+  void WriteBack(Block &block, const long index) {
+    std::lock_guard<std::mutex> lock(latch);
+    frame &f = frames[Fetch(index, false)];
+    f.block = block;
+    MarkDirty(f);
+    if (index >= block_count) {
+      block_count = index + 1;
+    }
+  }
+
+  // keep page index resident until the matching Unpin; the reference is valid until then
+  Block &Pin(const long index) {
+    std::lock_guard<std::mutex> lock(latch);
+    frame &f = frames[Fetch(index, true)];
+    ++f.pin_count;
+    return f.block;
+  }
+
+  void Unpin(const long index, const bool dirty = false) {
+    std::lock_guard<std::mutex> lock(latch);
+    const long f = FindFrame(index);
+    if (f == -1) {
+      return;
+    }
+    --frames[f].pin_count;
+    if (dirty) {
+      MarkDirty(frames[f]);
+    }
+  }
+
+  // when set, eviction only picks clean pages, so the file keeps the state of the last Flush
+  void SetNoSteal(const bool value) {
+    std::lock_guard<std::mutex> lock(latch);
+    no_steal = value;
+  }
+
+  long Capacity() const {
+    std::lock_guard<std::mutex> lock(latch);
+    return capacity;
+  }
+
+  // pages of the file, released ones included; a page written later is at or past this
+  long Pages() const {
+    std::lock_guard<std::mutex> lock(latch);
+    return block_count;
+  }
+
+  // Copy the first bytes of page index into out if the cache holds it, without counting that as a use.
+  // A pinned page may be changing under its holder without the latch, so it is not copied either.
+  bool Peek(const long index, void *out, const size_t bytes) const {
+    std::lock_guard<std::mutex> lock(latch);
+    const long f = FindFrame(index);
+    if (f == -1 || frames[f].pin_count > 0) {
+      return false;
+    }
+    std::memcpy(out, static_cast<const void *>(&frames[f].block), bytes);
+    return true;
+  }
+
+  long DirtyPages() const {
+    std::lock_guard<std::mutex> lock(latch);
+    return dirty_count;
+  }
+
+  // visit runs with the latch held, so it must not call back into the cache
+  template <typename Visit>
+  void ForEachDirty(Visit &&visit) const {
+    std::lock_guard<std::mutex> lock(latch);
+    for (long f = 0; f < used; ++f) {
+      if (frames[f].dirty) {
+        visit(frames[f].index, frames[f].block);
+      }
+    }
+  }
+
+  storage_header Header() const {
+    std::lock_guard<std::mutex> lock(latch);
+    return header;
+  }
+
+  void SetHeader(const storage_header &value) {
+    std::lock_guard<std::mutex> lock(latch);
+    header = value;
+  }
+
+  // write every dirty page and the header back to the file
+  void Flush() {
+    std::lock_guard<std::mutex> lock(latch);
+    WriteAll();
+  }
+
+  // Flush, then wait until the file has reached the disk
+  void Sync() {
+    Flush();
+    SyncPath(file_name);
   }
 };
 
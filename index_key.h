@@ -0,0 +1,179 @@
+#ifndef INDEX_KEY_H
+#define INDEX_KEY_H
+
+#include <cstring>
+#include <string>
+#include "exceptions.hpp"
+
+// The key an index string is stored under, compared word by word.
+template <int Words>
+struct index_key {
+  static_assert(Words >= 2, "a key has at least two words");
+
+  unsigned long long word[Words]{};
+
+  bool operator==(const index_key &other) const {
+    for (int i = 0; i < Words; ++i) {
+      if (word[i] != other.word[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+  bool operator<(const index_key &other) const {
+    for (int i = 0; i < Words; ++i) {
+      if (word[i] != other.word[i]) {
+        return word[i] < other.word[i];
+      }
+    }
+    return false;
+  }
+  bool operator>(const index_key &other) const {
+    return other < *this;
+  }
+  bool operator!=(const index_key &other) const {
+    return !(*this == other);
+  }
+  bool operator<=(const index_key &other) const {
+    return !(*this > other);
+  }
+  bool operator>=(const index_key &other) const {
+    return !(*this < other);
+  }
+};
+
+// A Keys policy turns index strings into keys. Format() names the encoding and is recorded in the map file,
+// Open(format) takes over the recorded one when an existing tree is opened and throws if it cannot read it.
+
+// Index strings are reduced to 128 bits of MurmurHash3. The order of the tree has nothing to do with the order
+// of the strings. Map files written before the format was recorded read 0 and are not opened.
+struct hashed_index {
+  static constexpr int WORDS = 2;
+  static constexpr bool ORDERED = false;
+
+  static long Format() {
+    return 1;
+  }
+
+  static void Open(const long stored) {
+    if (stored != Format()) {
+      throw sjtu::runtime_error();
+    }
+  }
+
+  static index_key<WORDS> Make(const std::string &str) {
+    return Murmur(str);
+  }
+
+  // MurmurHash3_x64_128 with seed 0, 16 bytes per round
+  static index_key<WORDS> Murmur(const std::string &str) {
+    constexpr unsigned long long C1 = 0x87c37b91114253d5ull;
+    constexpr unsigned long long C2 = 0x4cf5ad432745937full;
+    const unsigned char *data = reinterpret_cast<const unsigned char *>(str.data());
+    const size_t length = str.length();
+    unsigned long long h1 = 0, h2 = 0;
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+      unsigned long long k1, k2;
+      std::memcpy(&k1, data + i, 8);
+      std::memcpy(&k2, data + i + 8, 8);
+      h1 ^= Rotate(k1 * C1, 31) * C2;
+      h1 = (Rotate(h1, 27) + h2) * 5 + 0x52dce729;
+      h2 ^= Rotate(k2 * C2, 33) * C1;
+      h2 = (Rotate(h2, 31) + h1) * 5 + 0x38495ab5;
+    }
+    unsigned long long k1 = 0, k2 = 0;
+    for (size_t j = i; j < length; ++j) {
+      const unsigned long long byte = data[j];
+      if (j - i < 8) {
+        k1 |= byte << (j - i) * 8;
+      } else {
+        k2 |= byte << (j - i - 8) * 8;
+      }
+    }
+    if (length - i > 8) {
+      h2 ^= Rotate(k2 * C2, 33) * C1;
+    }
+    if (length > i) {
+      h1 ^= Rotate(k1 * C1, 31) * C2;
+    }
+    h1 ^= length;
+    h2 ^= length;
+    h1 += h2;
+    h2 += h1;
+    h1 = Mix(h1);
+    h2 = Mix(h2);
+    h1 += h2;
+    h2 += h1;
+    index_key<WORDS> key;
+    key.word[0] = h1;
+    key.word[1] = h2;
+    return key;
+  }
+
+private:
+  static unsigned long long Rotate(const unsigned long long x, const int r) {
+    return x << r | x >> (64 - r);
+  }
+
+  static unsigned long long Mix(unsigned long long x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
+  }
+};
+
+// Index strings of at most Bytes bytes are kept whole, packed big-endian into the words and padded with zero
+// bytes, so the tree is ordered like the strings and can answer prefix and range queries. Longer strings are
+// rejected, and a string must not contain a zero byte.
+template <int Bytes>
+struct string_index {
+  static_assert(Bytes % 8 == 0, "the width of a string key is a multiple of 8 bytes");
+  static constexpr int WORDS = Bytes / 8;
+  static constexpr bool ORDERED = true;
+
+  static long Format() {
+    return 0x100 + Bytes;
+  }
+
+  static void Open(const long stored) {
+    if (stored != Format()) {
+      throw sjtu::runtime_error();
+    }
+  }
+
+  // the key of str with every byte after it set to fill
+  static index_key<WORDS> Make(const std::string &str, const unsigned char fill = 0) {
+    if (str.length() > Bytes) {
+      throw sjtu::runtime_error();
+    }
+    index_key<WORDS> key;
+    for (size_t i = 0; i < Bytes; ++i) {
+      const unsigned char byte = i < str.length() ? static_cast<unsigned char>(str[i]) : fill;
+      key.word[i / 8] = key.word[i / 8] << 8 | byte;
+    }
+    return key;
+  }
+
+  // the largest key that starts with prefix
+  static index_key<WORDS> Last(const std::string &prefix) {
+    return Make(prefix, 0xff);
+  }
+
+  static std::string Text(const index_key<WORDS> &key) {
+    std::string str;
+    for (int i = 0; i < Bytes; ++i) {
+      const char byte = static_cast<char>(key.word[i / 8] >> (56 - i % 8 * 8) & 0xff);
+      if (byte == 0) {
+        break;
+      }
+      str.push_back(byte);
+    }
+    return str;
+  }
+};
+
+#endif //INDEX_KEY_H
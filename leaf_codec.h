@@ -0,0 +1,461 @@
+#ifndef LEAF_CODEC_H
+#define LEAF_CODEC_H
+
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// values of a packed run per block
+constexpr int PACK_BLOCK = 32;
+
+// Compressed layout of a leaf. Entries with the same index form a run that stores the index once:
+//   varints the words of the index, each as its difference to the run before while every word ahead of it
+//           matched, otherwise whole (the first run counts from an all zero index)
+//   varint  number of values in the run
+//   values  integral values as a zigzag varint followed by varint differences, anything else as raw bytes
+// A run of integral values that takes fewer bytes as a posting list is stored as one instead:
+//   varint  0, which no other run has as its number of values
+//   varint  number of values in the run
+//   varint  the first value, zigzag
+//   blocks  the differences less one, PACK_BLOCK to a block (the last one may have fewer): a byte with the
+//           bit width of the block, then the differences at that width one after another, little-endian
+// The many values of a popular index then take a few bits each, and are unpacked a block at a time.
+// Entry needs index.word[] and value, and the entries handed in must be sorted and unique.
+template <typename Entry, typename Value>
+class leaf_codec {
+  static constexpr bool PACKS = std::is_integral_v<Value>;
+
+  static int VarintSize(const unsigned long long x) {
+    return (70 - __builtin_clzll(x | 1)) / 7;
+  }
+
+  static unsigned char *PutVarint(unsigned char *out, unsigned long long x) {
+    while (x >= 128) {
+      *out++ = static_cast<unsigned char>(x | 128);
+      x >>= 7;
+    }
+    *out++ = static_cast<unsigned char>(x);
+    return out;
+  }
+
+  static const unsigned char *GetVarint(const unsigned char *in, unsigned long long &x) {
+    x = 0;
+    int shift = 0;
+    while (*in & 128) {
+      x |= static_cast<unsigned long long>(*in++ & 127) << shift;
+      shift += 7;
+    }
+    x |= static_cast<unsigned long long>(*in++) << shift;
+    return in;
+  }
+
+  static unsigned long long ZigZag(const Value &value) {
+    const long long x = static_cast<long long>(value);
+    return (static_cast<unsigned long long>(x) << 1) ^ static_cast<unsigned long long>(x >> 63);
+  }
+
+  static Value UnZigZag(const unsigned long long x) {
+    return static_cast<Value>(static_cast<long long>(x >> 1) ^ -static_cast<long long>(x & 1));
+  }
+
+  static unsigned long long Gap(const Value &from, const Value &to) {
+    return static_cast<unsigned long long>(static_cast<long long>(to)) -
+           static_cast<unsigned long long>(static_cast<long long>(from));
+  }
+
+  static Value After(const Value &from, const unsigned long long gap) {
+    return static_cast<Value>(static_cast<unsigned long long>(static_cast<long long>(from)) + gap);
+  }
+
+  // The width a block of differences less one is packed at, for their bits or-ed together. Above 57 bits a
+  // difference would not fit in one 8-byte load at its bit offset, those blocks take 64 bits.
+  static int Width(const unsigned long long bits) {
+    const int width = bits == 0 ? 0 : 64 - __builtin_clzll(bits);
+    return width > 57 ? 64 : width;
+  }
+
+  static long BlockBytes(const long n, const int width) {
+    return 1 + (n * width + 7) / 8;
+  }
+
+  // Bytes of the values of a run both ways, of which the smaller one is stored; the values are handed in
+  // in order. Encode, Size and sizer all decide through it.
+  class run_cost {
+    unsigned long long count = 0;
+    long varints = 0; // all values as varints
+    long first = 0; // the first value as a varint
+    long blocks = 0; // the full blocks of the posting list
+    int block = 0; // differences in the block being filled
+    unsigned long long bits = 0; // of those differences less one, or-ed together
+    Value last{};
+
+  public:
+    void Add(const Value &value) {
+      varints += ValueSize(value, count == 0 ? nullptr : &last);
+      if (count == 0) {
+        first = varints;
+      } else if constexpr (PACKS) {
+        bits |= Gap(last, value) - 1;
+        if (++block == PACK_BLOCK) {
+          blocks += BlockBytes(block, Width(bits));
+          block = 0;
+          bits = 0;
+        }
+      }
+      ++count;
+      last = value;
+    }
+
+    // the values alone as a posting list, which also has the marker in front of the number of values
+    long PackedValues() const {
+      return VarintSize(0) + first + blocks + (block > 0 ? BlockBytes(block, Width(bits)) : 0);
+    }
+
+    bool Packed() const {
+      return PACKS && count > 1 && PackedValues() < varints;
+    }
+
+    long Bytes() const {
+      return VarintSize(count) + (Packed() ? PackedValues() : varints);
+    }
+  };
+
+  // or x, which has width bits, into out at bit offset at; out starts zeroed
+  static void PutBits(unsigned char *out, const unsigned long long at, const unsigned long long x, const int width) {
+    for (int done = 0; done < width;) {
+      const int shift = (at + done) % 8;
+      out[(at + done) / 8] |= static_cast<unsigned char>(x >> done << shift);
+      done += 8 - shift;
+    }
+  }
+
+  // Unpack n values of width bits from in into out. Built with AVX2, blocks up to 25 bits wide are unpacked
+  // 8 values per instruction, each lane loading the 4 bytes its value starts in.
+  static void Unpack(const unsigned char *in, const int n, const int width, unsigned long long *out) {
+    if (width == 0) {
+      std::fill(out, out + n, 0ull);
+      return;
+    }
+    unsigned char buffer[PACK_BLOCK * 8 + 8]{}; // the loads of the last values may reach past the block
+    std::memcpy(buffer, in, (n * width + 7) / 8);
+    if (width == 64) {
+      std::memcpy(out, buffer, n * 8);
+      return;
+    }
+    const unsigned long long mask = (1ull << width) - 1;
+    int i = 0;
+#if defined(__AVX2__)
+    if (width <= 25) {
+      const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+      const __m256i wide = _mm256_set1_epi32(width);
+      const __m256i seven = _mm256_set1_epi32(7);
+      const __m256i low = _mm256_set1_epi32(static_cast<int>(mask));
+      for (; i + 8 <= n; i += 8) {
+        const __m256i at = _mm256_mullo_epi32(_mm256_add_epi32(lanes, _mm256_set1_epi32(i)), wide);
+        const __m256i words = _mm256_i32gather_epi32(reinterpret_cast<const int *>(buffer), _mm256_srli_epi32(at, 3), 1);
+        const __m256i x = _mm256_and_si256(_mm256_srlv_epi32(words, _mm256_and_si256(at, seven)), low);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm256_cvtepu32_epi64(_mm256_castsi256_si128(x)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i + 4), _mm256_cvtepu32_epi64(_mm256_extracti128_si256(x, 1)));
+      }
+    }
+#endif
+    for (; i < n; ++i) {
+      const unsigned long long at = static_cast<unsigned long long>(i) * width;
+      unsigned long long x;
+      std::memcpy(&x, buffer + at / 8, 8);
+      out[i] = x >> at % 8 & mask;
+    }
+  }
+
+  // the number of values after the head of a run, and whether they are a posting list
+  static const unsigned char *GetCount(const unsigned char *in, unsigned long long &count, bool &packed) {
+    in = GetVarint(in, count);
+    packed = count == 0;
+    return packed ? GetVarint(in, count) : in;
+  }
+
+  // hand the words of the run header of index to put when the run before it has index last
+  template <typename Index, typename Put>
+  static void HeadWords(const Index &index, const Index &last, Put &&put) {
+    constexpr int WORDS = std::extent_v<decltype(index.word)>;
+    bool same = true;
+    for (int i = 0; i < WORDS; ++i) {
+      const unsigned long long x = same ? index.word[i] - last.word[i] : index.word[i];
+      put(x);
+      same = same && x == 0;
+    }
+  }
+
+  // read the words of a run header into index, which holds the index of the run before
+  template <typename Index>
+  static const unsigned char *GetHead(const unsigned char *in, Index &index) {
+    bool same = true;
+    for (auto &word : index.word) {
+      unsigned long long x;
+      in = GetVarint(in, x);
+      word = same ? word + x : x;
+      same = same && x == 0;
+    }
+    return in;
+  }
+
+  static int HeadSize(const Entry &entry, const Entry &last) {
+    int size = 0;
+    HeadWords(entry.index, last.index, [&](const unsigned long long x) {
+      size += VarintSize(x);
+    });
+    return size;
+  }
+
+  // bytes of value when it follows previous in its run, previous is null for the first one
+  static int ValueSize(const Value &value, const Value *previous) {
+    if constexpr (std::is_integral_v<Value>) {
+      return VarintSize(previous == nullptr ? ZigZag(value) : Gap(*previous, value));
+    } else {
+      return sizeof(Value);
+    }
+  }
+
+  // move in past the count values of a run without decoding them
+  static const unsigned char *SkipValues(const unsigned char *in, const unsigned long long count, const bool packed) {
+    if (packed) {
+      while (*in++ & 128) {}
+      for (unsigned long long done = 1; done < count; done += PACK_BLOCK) {
+        in += BlockBytes(std::min<unsigned long long>(PACK_BLOCK, count - done), *in);
+      }
+      return in;
+    }
+    if constexpr (std::is_integral_v<Value>) {
+      for (unsigned long long i = 0; i < count; ++i) {
+        while (*in++ & 128) {}
+      }
+      return in;
+    } else {
+      return in + count * sizeof(Value);
+    }
+  }
+
+  // the values of a posting list for GetValues, the first one goes out with the first block
+  template <typename Emit>
+  static const unsigned char *GetPacked(const unsigned char *in, const unsigned long long count, Emit &&emit) {
+    Value values[PACK_BLOCK + 1];
+    unsigned long long x, gaps[PACK_BLOCK];
+    in = GetVarint(in, x);
+    Value value = UnZigZag(x);
+    values[0] = value;
+    int n = 1;
+    for (unsigned long long done = 1; done < count; done += PACK_BLOCK) {
+      const int block = std::min<unsigned long long>(PACK_BLOCK, count - done);
+      const int width = *in;
+      Unpack(in + 1, block, width, gaps);
+      in += BlockBytes(block, width);
+      for (int i = 0; i < block; ++i) {
+        value = After(value, gaps[i] + 1);
+        values[n++] = value;
+      }
+      emit(static_cast<const Value *>(values), n);
+      n = 0;
+    }
+    return in;
+  }
+
+  // write the values of a run as a posting list, from the number of values on
+  static unsigned char *PutPacked(unsigned char *out, const Entry *entries, const long n) {
+    out = PutVarint(out, 0);
+    out = PutVarint(out, n);
+    out = PutVarint(out, ZigZag(entries[0].value));
+    for (long block = 1; block < n; block += PACK_BLOCK) {
+      const long end = std::min(n, block + PACK_BLOCK);
+      unsigned long long bits = 0;
+      for (long j = block; j < end; ++j) {
+        bits |= Gap(entries[j - 1].value, entries[j].value) - 1;
+      }
+      const int width = Width(bits);
+      const long bytes = BlockBytes(end - block, width);
+      std::memset(out, 0, bytes);
+      *out = static_cast<unsigned char>(width);
+      for (long j = block; j < end; ++j) {
+        PutBits(out + 1, (j - block) * width, Gap(entries[j - 1].value, entries[j].value) - 1, width);
+      }
+      out += bytes;
+    }
+    return out;
+  }
+
+  // hand the count values of a run to emit(values, n), up to PACK_BLOCK + 1 at a time
+  template <typename Emit>
+  static const unsigned char *GetValues(const unsigned char *in, const unsigned long long count, const bool packed,
+                                        Emit &&emit) {
+    if constexpr (PACKS) {
+      if (packed) {
+        return GetPacked(in, count, emit);
+      }
+    }
+    Value values[PACK_BLOCK];
+    int n = 0;
+    Value value{};
+    for (unsigned long long i = 0; i < count; ++i) {
+      if constexpr (std::is_integral_v<Value>) {
+        unsigned long long x;
+        in = GetVarint(in, x);
+        value = i == 0 ? UnZigZag(x) : After(value, x);
+      } else {
+        std::memcpy(static_cast<void *>(&value), in, sizeof(Value));
+        in += sizeof(Value);
+      }
+      values[n++] = value;
+      if (n == PACK_BLOCK) {
+        emit(static_cast<const Value *>(values), n);
+        n = 0;
+      }
+    }
+    if (n > 0) {
+      emit(static_cast<const Value *>(values), n);
+    }
+    return in;
+  }
+
+public:
+  // size of an encoding that sorted entries are appended to one at a time
+  class sizer {
+    long bytes = 0; // of the runs before the last one and the head of the last one
+    run_cost run;
+    Entry last{};
+    bool any = false;
+
+  public:
+    long Bytes() const {
+      return any ? bytes + run.Bytes() : 0;
+    }
+
+    // Bytes() after entry would be added
+    long With(const Entry &entry) const {
+      if (!any || entry.index != last.index) {
+        return Bytes() + HeadSize(entry, last) + VarintSize(1) + ValueSize(entry.value, nullptr);
+      }
+      run_cost next = run;
+      next.Add(entry.value);
+      return bytes + next.Bytes();
+    }
+
+    void Add(const Entry &entry) {
+      if (!any || entry.index != last.index) {
+        bytes = Bytes() + HeadSize(entry, last);
+        run = run_cost();
+      }
+      run.Add(entry.value);
+      last = entry;
+      any = true;
+    }
+  };
+
+  static long Size(const Entry *entries, const long n) {
+    sizer total;
+    for (long i = 0; i < n; ++i) {
+      total.Add(entries[i]);
+    }
+    return total.Bytes();
+  }
+
+  // write entries[0, n) to out and return the number of bytes used
+  static long Encode(const Entry *entries, const long n, unsigned char *out) {
+    unsigned char *begin = out;
+    for (long i = 0; i < n;) {
+      long end = i + 1;
+      run_cost run;
+      run.Add(entries[i].value);
+      while (end < n && entries[end].index == entries[i].index) {
+        run.Add(entries[end++].value);
+      }
+      HeadWords(entries[i].index, i == 0 ? Entry{}.index : entries[i - 1].index, [&](const unsigned long long x) {
+        out = PutVarint(out, x);
+      });
+      if constexpr (PACKS) {
+        if (run.Packed()) {
+          out = PutPacked(out, entries + i, end - i);
+          i = end;
+          continue;
+        }
+      }
+      out = PutVarint(out, end - i);
+      for (long j = i; j < end; ++j) {
+        if constexpr (std::is_integral_v<Value>) {
+          out = PutVarint(out, j == i ? ZigZag(entries[j].value) : Gap(entries[j - 1].value, entries[j].value));
+        } else {
+          std::memcpy(out, &entries[j].value, sizeof(Value));
+          out += sizeof(Value);
+        }
+      }
+      i = end;
+    }
+    return out - begin;
+  }
+
+  // hand every entry stored in in[0, bytes) to emit, in order
+  template <typename Emit>
+  static void Decode(const unsigned char *in, const long bytes, Emit &&emit) {
+    const unsigned char *end = in + bytes;
+    Entry entry{};
+    while (in < end) {
+      unsigned long long count;
+      bool packed;
+      in = GetHead(in, entry.index);
+      in = GetCount(in, count, packed);
+      in = GetValues(in, count, packed, [&](const Value *values, const int n) {
+        for (int i = 0; i < n; ++i) {
+          entry.value = values[i];
+          emit(entry);
+        }
+      });
+    }
+  }
+
+  // Hand the values stored under index to emit(values, n), a block at a time. Returns true when the run of
+  // index may go on in the next leaf, that is when nothing larger than index was found here.
+  template <typename Index, typename Emit>
+  static bool Scan(const unsigned char *in, const long bytes, const Index &index, Emit &&emit) {
+    const unsigned char *end = in + bytes;
+    Index current{};
+    while (in < end) {
+      unsigned long long count;
+      bool packed;
+      in = GetHead(in, current);
+      in = GetCount(in, count, packed);
+      if (current < index) {
+        in = SkipValues(in, count, packed);
+      } else if (current == index) {
+        in = GetValues(in, count, packed, emit);
+      } else {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Add the number of values stored under index to count, taken from the run headers; the values are
+  // skipped, not decoded. Returns what Scan would.
+  template <typename Index>
+  static bool Count(const unsigned char *in, const long bytes, const Index &index, long long &count) {
+    const unsigned char *end = in + bytes;
+    Index current{};
+    while (in < end) {
+      unsigned long long n;
+      bool packed;
+      in = GetHead(in, current);
+      in = GetCount(in, n, packed);
+      if (index < current) {
+        return false;
+      }
+      if (current == index) {
+        count += n;
+      }
+      in = SkipValues(in, n, packed);
+    }
+    return true;
+  }
+};
+
+#endif //LEAF_CODEC_H
@@ -1,9 +1,40 @@
+#include <algorithm>
 #include <iostream>
 #include "b_plus_tree.h"
 
-int main() {
+// "code bulk" reads n pairs of index and value and builds a fresh tree from them in one pass
+void BulkLoad(sjtu::bpt<int> &bpt) {
+  using entry = sjtu::bpt<int>::entry;
+  int n;
+  std::cin >> n;
+  sjtu::vector<entry> entries;
+  for (int i = 0; i < n; ++i) {
+    std::string index;
+    int value;
+    std::cin >> index >> value;
+    entries.push_back(bpt.MakeEntry(index, value));
+  }
+  if (!entries.empty()) {
+    std::sort(&entries[0], &entries[0] + entries.size());
+  }
+  size_t next = 0;
+  bpt.BulkLoad([&](entry &item) {
+    if (next == entries.size()) {
+      return false;
+    }
+    item = entries[next++];
+    return true;
+  });
+}
+
+int main(int argc, char *argv[]) {
   sjtu::bpt<int> bpt("map_file.txt", "data_file.txt");
 
+  if (argc > 1 && std::string(argv[1]) == "bulk") {
+    BulkLoad(bpt);
+    return 0;
+  }
+
   int n;
   std::cin >> n;
   for (int i = 0; i < n; ++i) {
@@ -22,11 +53,12 @@ int main() {
     } else if (command == "find") {
       std::string index;
       std::cin >> index;
-      const auto ans = bpt.Find(index);
-      for (const auto it : ans) {
-        std::cout << it << ' ';
-      }
-      if (ans.empty()) {
+      bool found = false;
+      bpt.Find(index, [&found](const int value) {
+        std::cout << value << ' ';
+        found = true;
+      });
+      if (!found) {
         std::cout << "null";
       }
       std::cout << '\n';
@@ -0,0 +1,136 @@
+#ifndef MEMTABLE_H
+#define MEMTABLE_H
+
+#include "vector.hpp"
+
+// A skip list of entries (anything with operator< and operator==) kept in memory, each marked as an insert or
+// a delete. Putting an entry that is already there replaces its mark. The nodes live in one vector and their
+// links in another, so the list grows without an allocation per entry.
+// Nodes are named by their place in the first vector; -1 is past the last one.
+template <typename Entry>
+class memtable {
+  static constexpr int MAX_HEIGHT = 16;
+
+  struct node {
+    Entry entry;
+    bool insert = true;
+    long links = 0; // its link on level i is links[links + i]
+  };
+
+  sjtu::vector<node> nodes; // nodes[0] is the head, which stands before every entry and has all levels
+  sjtu::vector<long> links;
+  int height = 1; // levels in use
+  unsigned long long seed = 0x9e3779b97f4a7c15ull;
+
+  long &Link(const long at, const int level) {
+    return links[nodes[at].links + level];
+  }
+
+  long Link(const long at, const int level) const {
+    return links[nodes[at].links + level];
+  }
+
+  // every level above the first is taken with a chance of 1/4
+  int RandomHeight() {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    int levels = 1;
+    for (unsigned long long bits = seed; levels < MAX_HEIGHT && (bits & 3) == 0; bits >>= 2) {
+      ++levels;
+    }
+    return levels;
+  }
+
+  // the last node whose entry is before(entry); the last such node of every level goes to path if given
+  template <typename Before>
+  long Last(Before &before, long *path) const {
+    long at = 0;
+    for (int level = height - 1; level >= 0; --level) {
+      for (long next = Link(at, level); next != -1 && before(nodes[next].entry); next = Link(at, level)) {
+        at = next;
+      }
+      if (path != nullptr) {
+        path[level] = at;
+      }
+    }
+    return at;
+  }
+
+public:
+  memtable() {
+    nodes.push_back(node());
+    for (int i = 0; i < MAX_HEIGHT; ++i) {
+      links.push_back(-1);
+    }
+  }
+
+  long Size() const {
+    return nodes.size() - 1;
+  }
+
+  bool Empty() const {
+    return nodes.size() == 1;
+  }
+
+  // drop every entry, the head stays
+  void Clear() {
+    while (nodes.size() > 1) {
+      nodes.pop_back();
+    }
+    while (links.size() > MAX_HEIGHT) {
+      links.pop_back();
+    }
+    for (int i = 0; i < MAX_HEIGHT; ++i) {
+      links[i] = -1;
+    }
+    height = 1;
+  }
+
+  void Put(const Entry &entry, const bool insert) {
+    long path[MAX_HEIGHT];
+    auto before = [&entry](const Entry &other) { return other < entry; };
+    const long found = Link(Last(before, path), 0);
+    if (found != -1 && nodes[found].entry == entry) {
+      nodes[found].insert = insert;
+      return;
+    }
+    const int levels = RandomHeight();
+    for (; height < levels; ++height) {
+      path[height] = 0;
+    }
+    const long added = nodes.size();
+    nodes.push_back({entry, insert, static_cast<long>(links.size())});
+    for (int level = 0; level < levels; ++level) {
+      const long next = Link(path[level], level);
+      links.push_back(next);
+    }
+    for (int level = 0; level < levels; ++level) {
+      Link(path[level], level) = added;
+    }
+  }
+
+  // the first node whose entry is not before(entry)
+  template <typename Before>
+  long Seek(Before &&before) const {
+    return Link(Last(before, nullptr), 0);
+  }
+
+  long First() const {
+    return Link(0, 0);
+  }
+
+  long Next(const long at) const {
+    return Link(at, 0);
+  }
+
+  const Entry &At(const long at) const {
+    return nodes[at].entry;
+  }
+
+  bool Inserts(const long at) const {
+    return nodes[at].insert;
+  }
+};
+
+#endif //MEMTABLE_H
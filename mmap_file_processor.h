@@ -0,0 +1,174 @@
+#ifndef MMAP_FILE_PROCESSOR_H
+#define MMAP_FILE_PROCESSOR_H
+
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "exceptions.hpp"
+#include "file_processor.h"
+
+constexpr long MMAP_RESERVE_BYTES = 1l << 36; // address space kept for the mapping, 64 GiB
+constexpr long MMAP_GROW_PAGES = 1024; // the mapping and the file are extended by this many pages at a time
+
+// same interface as file_processor, but the blocks live directly in a shared mapping of the file
+template <typename Block, long PageBytes = FILE_UNIT_SIZE>
+class mmap_file_processor {
+  static_assert(sizeof(Block) <= PageBytes && sizeof(storage_header) <= PageBytes, "a block must fit in one page");
+
+  int fd = -1;
+  char *base = nullptr; // start of the reserved range, the file is mapped at its beginning
+  long block_count = 0; // pages in use
+  // length of the file, up to a step of MMAP_GROW_PAGES past block_count until Flush; a crash in between
+  // leaves zeroed pages at the end that the tree never reaches
+  long file_pages = 0;
+  long mapped_pages = 0; // pages of the reserved range backed by the file
+
+  // map the file over the reservation far enough to cover pages [0, pages)
+  void Reserve(const long pages) {
+    if (pages <= mapped_pages) {
+      return;
+    }
+    long target = (pages + MMAP_GROW_PAGES - 1) / MMAP_GROW_PAGES * MMAP_GROW_PAGES;
+    if (target * PageBytes > MMAP_RESERVE_BYTES) {
+      target = MMAP_RESERVE_BYTES / PageBytes;
+      if (pages > target) {
+        throw sjtu::runtime_error();
+      }
+    }
+    void *chunk = mmap(base + mapped_pages * PageBytes, (target - mapped_pages) * PageBytes,
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, mapped_pages * PageBytes);
+    if (chunk == MAP_FAILED) {
+      throw sjtu::runtime_error();
+    }
+    mapped_pages = target;
+  }
+
+  void Resize(const long pages) {
+    if (ftruncate(fd, pages * PageBytes) != 0) {
+      throw sjtu::runtime_error();
+    }
+    file_pages = pages;
+  }
+
+  // cut the file back to the pages in use; if that fails the file only stays longer, so it is not an error
+  void Trim() {
+    if (file_pages != block_count && ftruncate(fd, block_count * PageBytes) == 0) {
+      file_pages = block_count;
+    }
+  }
+
+  Block *Address(const long index) const {
+    return reinterpret_cast<Block *>(base + index * PageBytes);
+  }
+
+  storage_header &Header() const {
+    return *reinterpret_cast<storage_header *>(base);
+  }
+
+public:
+  explicit mmap_file_processor(const std::string &file_name, const long = DEFAULT_CACHE_PAGES) {
+    fd = open(file_name.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+      throw sjtu::runtime_error();
+    }
+    const long end = lseek(fd, 0, SEEK_END);
+    block_count = (end + PageBytes - 1) / PageBytes;
+    const bool fresh = block_count == 0;
+    if (fresh) {
+      block_count = 1;
+    }
+    Resize(block_count); // a partly written last page becomes a whole one
+    void *range = mmap(nullptr, MMAP_RESERVE_BYTES, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (range == MAP_FAILED) {
+      throw sjtu::runtime_error();
+    }
+    base = static_cast<char *>(range);
+    Reserve(block_count);
+    if (fresh) {
+      Header() = storage_header();
+      Header().page_size = PageBytes;
+    } else if (!Header().Accepts(PageBytes)) {
+      munmap(base, MMAP_RESERVE_BYTES);
+      close(fd);
+      throw sjtu::runtime_error(); // the file was created with another page size
+    }
+  }
+
+  ~mmap_file_processor() {
+    Flush();
+    munmap(base, MMAP_RESERVE_BYTES);
+    close(fd);
+  }
+
+  mmap_file_processor(const mmap_file_processor &) = delete;
+  mmap_file_processor &operator=(const mmap_file_processor &) = delete;
+
+  // the page cache of the kernel does the caching, so there is nothing to size
+  void SetCapacity(const long) {}
+
+  void SetCapacityBytes(const long) {}
+
+  Block ReadBlock(const int index) {
+    return *Address(index);
+  }
+
+  // store block in a released page if there is one, otherwise append it to the file
+  long WriteBlock(Block &block) {
+    if (Header().free_head != -1) {
+      const long index = Header().free_head;
+      std::memcpy(&Header().free_head, Address(index), sizeof(long));
+      std::memcpy(static_cast<void *>(Address(index)), &block, sizeof(Block));
+      return index;
+    }
+    const long index = block_count;
+    if (index >= file_pages) { // one ftruncate per step of the mapping, not per page
+      Reserve(index + 1);
+      Resize(mapped_pages);
+    }
+    ++block_count;
+    std::memcpy(static_cast<void *>(Address(index)), &block, sizeof(Block));
+    return index;
+  }
+
+  // give page index back for reuse by WriteBlock, its content is lost
+  void Release(const long index) {
+    std::memcpy(static_cast<void *>(Address(index)), &Header().free_head, sizeof(long));
+    Header().free_head = index;
+  }
+
+  void WriteBack(Block &block, const long index) {
+    if (&block != Address(index)) {
+      std::memcpy(static_cast<void *>(Address(index)), &block, sizeof(Block));
+    }
+  }
+
+  // addresses never move because the mapping only grows inside the reservation
+  Block &Pin(const long index) {
+    return *Address(index);
+  }
+
+  void Unpin(const long, const bool = false) {}
+
+  long Pages() const {
+    return block_count;
+  }
+
+  // there is no cache of its own to look into
+  bool Peek(const long, void *, const size_t) const {
+    return false;
+  }
+
+  void Flush() {
+    Trim();
+    msync(base, block_count * PageBytes, MS_ASYNC);
+  }
+
+  void Sync() {
+    Trim();
+    msync(base, block_count * PageBytes, MS_SYNC);
+  }
+};
+
+#endif //MMAP_FILE_PROCESSOR_H
@@ -0,0 +1,50 @@
+#ifndef NODE_SEARCH_H
+#define NODE_SEARCH_H
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#include <immintrin.h>
+#endif
+
+// the binary search in CountBelow stops at this many keys, the rest are compared all at once
+constexpr int SEARCH_WINDOW = 16;
+
+// Number of keys[0, n) below key, or not above it if Inclusive; keys must be sorted.
+// Built with AVX2 or SSE4.2 the last window is compared 4 or 2 keys per instruction, otherwise one by one.
+template <bool Inclusive = false>
+inline int CountBelow(const unsigned long long *keys, int n, const unsigned long long key) {
+  const unsigned long long *first = keys;
+  while (n > SEARCH_WINDOW) {
+    const int half = n >> 1;
+    const bool below = Inclusive ? first[half] <= key : first[half] < key;
+    first = below ? first + half + 1 : first;
+    n = below ? n - half - 1 : half;
+  }
+  int count = first - keys;
+  int i = 0;
+  // the compare instructions are signed, flipping the top bit makes them order unsigned values
+#if defined(__AVX2__)
+  const __m256i flip = _mm256_set1_epi64x(static_cast<long long>(1ull << 63));
+  const __m256i bound = _mm256_xor_si256(_mm256_set1_epi64x(static_cast<long long>(key)), flip);
+  for (; i + 4 <= n; i += 4) {
+    const __m256i x = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(first + i)), flip);
+    const __m256i above = Inclusive ? _mm256_cmpgt_epi64(x, bound) : _mm256_cmpgt_epi64(bound, x);
+    const int hits = __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(above)));
+    count += Inclusive ? 4 - hits : hits;
+  }
+#elif defined(__SSE4_2__)
+  const __m128i flip = _mm_set1_epi64x(static_cast<long long>(1ull << 63));
+  const __m128i bound = _mm_xor_si128(_mm_set1_epi64x(static_cast<long long>(key)), flip);
+  for (; i + 2 <= n; i += 2) {
+    const __m128i x = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(first + i)), flip);
+    const __m128i above = Inclusive ? _mm_cmpgt_epi64(x, bound) : _mm_cmpgt_epi64(bound, x);
+    const int hits = __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(above)));
+    count += Inclusive ? 2 - hits : hits;
+  }
+#endif
+  for (; i < n; ++i) {
+    count += Inclusive ? first[i] <= key : first[i] < key;
+  }
+  return count;
+}
+
+#endif //NODE_SEARCH_H
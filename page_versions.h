@@ -0,0 +1,184 @@
+#ifndef PAGE_VERSIONS_H
+#define PAGE_VERSIONS_H
+
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unistd.h>
+#include "file_processor.h"
+#include "vector.hpp"
+
+constexpr long SNAPSHOT_CACHE_PAGES = 64;
+
+// The earlier versions of pages that open snapshots of a tree still read. A snapshot is named by the epoch it
+// was opened in. Before a page changes for the first time after the newest open snapshot, the tree hands its
+// content to Preserve, which copies it aside under that epoch; a snapshot then reads a page from the first copy
+// made in or after its epoch, or from the tree if the page has not changed since. Copies no snapshot can reach
+// any more are released when a snapshot closes.
+// The copies live in a file of their own that is unlinked as soon as it is open, so none of it outlives the process.
+template <typename Block, long PageBytes, template <typename, long> class Storage>
+class page_versions {
+
+  struct saved_page {
+    long pos = -1; // page of the tree, -1 while the record is free
+    long copy = -1; // page of copies
+    long long epoch = 0; // the newest open snapshot when the copy was made
+    long next = -1; // next record in the same bucket, or the next free record
+  };
+
+  struct open_snapshot {
+    long long epoch;
+    long pages; // pages the tree had, the snapshot never reaches any page from there on
+  };
+
+  Storage<Block, PageBytes> copies;
+  sjtu::vector<saved_page> records;
+  sjtu::vector<long> buckets; // a power of two of them, kept at least as many as used records
+  long free_record = -1;
+  long used = 0;
+  sjtu::vector<open_snapshot> open; // in increasing epoch
+  long long epoch = 0;
+  std::atomic<bool> any = false; // whether a snapshot is open, checked by Preserve before it takes the latch
+  mutable std::shared_mutex latch; // shared by Read, exclusive for everything that changes the records
+
+  static const std::string &Fresh(const std::string &file_name) {
+    unlink(file_name.c_str());
+    return file_name;
+  }
+
+  // the copy of pos with the smallest epoch not below from, -1 if there is none
+  long Find(const long pos, const long long from) const {
+    long found = -1;
+    for (long r = buckets[pos & (buckets.size() - 1)]; r != -1; r = records[r].next) {
+      if (records[r].pos == pos && records[r].epoch >= from && (found == -1 || records[r].epoch < records[found].epoch)) {
+        found = r;
+      }
+    }
+    return found;
+  }
+
+  void Link(const long r) {
+    long &head = buckets[records[r].pos & (buckets.size() - 1)];
+    records[r].next = head;
+    head = r;
+  }
+
+  void Add(const saved_page &page) {
+    long r = free_record;
+    if (r != -1) {
+      free_record = records[r].next;
+      records[r] = page;
+    } else {
+      r = records.size();
+      records.push_back(page);
+    }
+    Link(r);
+    if (++used > static_cast<long>(buckets.size())) {
+      const size_t count = buckets.size() * 2;
+      buckets.clear();
+      for (size_t i = 0; i < count; ++i) {
+        buckets.push_back(-1);
+      }
+      for (size_t i = 0; i < records.size(); ++i) {
+        if (records[i].pos != -1) {
+          Link(i);
+        }
+      }
+    }
+  }
+
+  void Remove(const long r) {
+    long *link = &buckets[records[r].pos & (buckets.size() - 1)];
+    while (*link != r) {
+      link = &records[*link].next;
+    }
+    *link = records[r].next;
+    copies.Release(records[r].copy);
+    records[r].pos = -1;
+    records[r].next = free_record;
+    free_record = r;
+    --used;
+  }
+
+  // A copy is read by the open snapshots after the previous copy of its page, up to its own epoch.
+  bool Needed(const long r) const {
+    long long previous = 0;
+    for (long other = buckets[records[r].pos & (buckets.size() - 1)]; other != -1; other = records[other].next) {
+      if (records[other].pos == records[r].pos && records[other].epoch < records[r].epoch &&
+          records[other].epoch > previous) {
+        previous = records[other].epoch;
+      }
+    }
+    for (size_t i = 0; i < open.size(); ++i) {
+      if (open[i].epoch > previous && open[i].epoch <= records[r].epoch) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+public:
+  explicit page_versions(const std::string &file_name) : copies(Fresh(file_name), SNAPSHOT_CACHE_PAGES) {
+    unlink(file_name.c_str());
+    for (int i = 0; i < 64; ++i) {
+      buckets.push_back(-1);
+    }
+  }
+
+  page_versions(const page_versions &) = delete;
+  page_versions &operator=(const page_versions &) = delete;
+
+  // Open a snapshot of a tree of pages pages and return its epoch. Nothing may change the tree meanwhile.
+  long long Open(const long pages) {
+    std::unique_lock<std::shared_mutex> lock(latch);
+    open.push_back({++epoch, pages});
+    any = true;
+    return epoch;
+  }
+
+  void Close(const long long snapshot) {
+    std::unique_lock<std::shared_mutex> lock(latch);
+    for (size_t i = 0; i < open.size(); ++i) {
+      if (open[i].epoch == snapshot) {
+        open.erase(i);
+        break;
+      }
+    }
+    any = !open.empty();
+    for (size_t r = 0; r < records.size(); ++r) {
+      if (records[r].pos != -1 && !Needed(r)) {
+        Remove(r);
+      }
+    }
+  }
+
+  // Page pos of the tree is about to change or be released; current() returns what it holds now.
+  // Calls for the same page must not overlap, calls for different pages may.
+  template <typename Current>
+  void Preserve(const long pos, Current &&current) {
+    if (!any) {
+      return;
+    }
+    std::unique_lock<std::shared_mutex> lock(latch);
+    if (open.empty()) {
+      return;
+    }
+    const open_snapshot &newest = open.back();
+    if (pos >= newest.pages || Find(pos, newest.epoch) != -1) {
+      return;
+    }
+    Block page = current();
+    Add({pos, copies.WriteBlock(page), newest.epoch});
+  }
+
+  // page pos as the snapshot sees it, live(pos) reads it from the tree when it has not changed
+  template <typename Live>
+  Block Read(const long long snapshot, const long pos, Live &&live) {
+    std::shared_lock<std::shared_mutex> lock(latch);
+    const long r = Find(pos, snapshot);
+    return r == -1 ? live(pos) : copies.ReadBlock(records[r].copy);
+  }
+};
+
+#endif //PAGE_VERSIONS_H
@@ -0,0 +1,118 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include "file_processor.h"
+
+constexpr int DEFAULT_READAHEAD_LEAVES = 8;
+
+// Background reader that follows Block::next_block through the data file, so that the pages a scan is
+// about to visit are already in the page cache of the system when the scan asks for them.
+// A page the cache of the storage holds is not read at all, its link is taken from there (Cache::Peek).
+// Other pages are read from the file, where a page that changed since the last write-back is simply
+// seen in its older version, which can only make the hint less accurate.
+template <typename Block, long PageBytes, typename Cache>
+class chain_readahead {
+
+  std::string file_name;
+  const Cache &cache;
+  int fd = -1;
+  std::atomic<int> depth = DEFAULT_READAHEAD_LEAVES; // read by the threads that give hints
+
+  std::thread worker;
+  std::mutex latch;
+  std::condition_variable wake;
+  long start = -1; // first page of the requested chain, -1 when there is nothing to do
+  long generation = 0; // changes with every request, a running walk stops when it does
+  bool stop = false;
+
+  void Run() {
+    Block block;
+    std::unique_lock<std::mutex> lock(latch);
+    while (true) {
+      wake.wait(lock, [this] { return stop || start != -1; });
+      if (stop) {
+        return;
+      }
+      long index = start;
+      const long walk = generation;
+      const int pages = depth;
+      start = -1;
+      lock.unlock();
+      for (int i = 0; i < pages && index > 0; ++i) {
+        if (!cache.Peek(index, &block, sizeof(Block)) &&
+            pread(fd, &block, sizeof(Block), index * PageBytes) != static_cast<long>(sizeof(Block))) {
+          break;
+        }
+        index = block.next_block;
+        lock.lock();
+        const bool superseded = generation != walk || stop;
+        lock.unlock();
+        if (superseded) {
+          break;
+        }
+      }
+      lock.lock();
+    }
+  }
+
+public:
+  chain_readahead(const std::string &file_name, const Cache &cache) : file_name(file_name), cache(cache) {}
+
+  ~chain_readahead() {
+    if (worker.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(latch);
+        stop = true;
+      }
+      wake.notify_one();
+      worker.join();
+    }
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+
+  chain_readahead(const chain_readahead &) = delete;
+  chain_readahead &operator=(const chain_readahead &) = delete;
+
+  // number of pages read ahead of each hint, 0 turns readahead off
+  void SetDepth(const int leaves) {
+    std::lock_guard<std::mutex> lock(latch);
+    depth = leaves;
+  }
+
+  int Depth() const {
+    return depth;
+  }
+
+  // Start reading the chain beginning at page index; replaces any walk still in progress. A scan hints the
+  // link of the leaf it has just read, not that leaf itself.
+  void Hint(const long index) {
+    if (depth <= 0 || index <= 0) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(latch);
+      if (!worker.joinable()) {
+        fd = open(file_name.c_str(), O_RDONLY);
+        if (fd == -1) {
+          depth = 0;
+          return;
+        }
+        worker = std::thread(&chain_readahead::Run, this);
+      }
+      start = index;
+      ++generation;
+    }
+    wake.notify_one();
+  }
+};
+
+#endif //READAHEAD_H
@@ -0,0 +1,214 @@
+#ifndef SHARDED_BPT_H
+#define SHARDED_BPT_H
+
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <utility>
+#include "b_plus_tree.h"
+
+namespace sjtu {
+  // N independent trees, each index belongs to the one its MurmurHash3 picks. Shard i keeps its tree in
+  // map + "." + i and data + "." + i, so the same files must always be opened with the same N.
+  // Single calls run in the calling thread. Execute splits a batch of commands by shard and hands each part to
+  // the worker thread of its shard, so the shards work through a batch in parallel.
+  template <typename Value, int N, long PageBytes = FILE_UNIT_SIZE,
+            template <typename, long> class Storage = file_processor, typename Keys = hashed_index>
+  class sharded_bpt {
+    static_assert(N > 0, "a sharded tree has at least one shard");
+
+  public:
+    using tree = bpt<Value, PageBytes, Storage, Keys>;
+
+    static constexpr int INSERT = 0, DELETE = 1, FIND = 2;
+
+    struct command {
+      int kind = FIND;
+      std::string index;
+      Value value{}; // not used by FIND
+    };
+
+  private:
+    // the commands of one batch that belong to a shard, in batch order
+    struct job {
+      std::span<const command> batch;
+      const vector<int> *commands;
+      vector<vector<Value>> *results;
+      int *remaining; // parts of the batch not finished yet, guarded by done_latch like error
+      std::exception_ptr *error; // the first exception a part of the batch ended with
+    };
+
+    struct shard {
+      tree data;
+      std::thread worker;
+      std::mutex latch;
+      std::condition_variable wake;
+      vector<job> pending;
+      bool stop = false;
+
+      shard(const std::string &map, const std::string &data_file, const long cache_pages) :
+          data(map, data_file, cache_pages) {}
+    };
+
+    shard *shards[N];
+    std::mutex done_latch;
+    std::condition_variable done;
+
+    static int ShardOf(const std::string &index) {
+      return hashed_index::Murmur(index).word[1] % N;
+    }
+
+    // A run of inserts goes to the tree as one InsertBatch; the order against deletes and finds is kept.
+    static void Run(tree &data, const job &work) {
+      const vector<int> &commands = *work.commands;
+      vector<std::pair<std::string, Value>> inserts;
+      for (size_t i = 0; i < commands.size(); ++i) {
+        const command &item = work.batch[commands[i]];
+        if (item.kind == INSERT) {
+          inserts.push_back({item.index, item.value});
+          if (i + 1 < commands.size() && work.batch[commands[i + 1]].kind == INSERT) {
+            continue;
+          }
+          if (inserts.size() == 1) {
+            data.Insert(inserts[0].first, inserts[0].second);
+          } else {
+            data.InsertBatch(std::span<const std::pair<std::string, Value>>(&inserts[0], inserts.size()));
+          }
+          inserts.clear();
+        } else if (item.kind == DELETE) {
+          data.Delete(item.index, item.value);
+        } else {
+          (*work.results)[commands[i]] = data.Find(item.index);
+        }
+      }
+    }
+
+    void Work(shard &self) {
+      std::unique_lock<std::mutex> lock(self.latch);
+      while (true) {
+        self.wake.wait(lock, [&self] { return self.stop || !self.pending.empty(); });
+        if (self.pending.empty()) {
+          return;
+        }
+        const job work = self.pending.front();
+        self.pending.erase(0);
+        lock.unlock();
+        std::exception_ptr error;
+        try {
+          Run(self.data, work);
+        } catch (...) {
+          error = std::current_exception();
+        }
+        {
+          std::lock_guard<std::mutex> guard(done_latch);
+          if (error && !*work.error) {
+            *work.error = error;
+          }
+          --*work.remaining;
+        }
+        done.notify_all();
+        lock.lock();
+      }
+    }
+
+  public:
+    sharded_bpt(const std::string &map, const std::string &data, const long cache_pages = DEFAULT_CACHE_PAGES) {
+      for (int i = 0; i < N; ++i) {
+        shards[i] = new shard(map + "." + std::to_string(i), data + "." + std::to_string(i), cache_pages);
+        shards[i]->worker = std::thread(&sharded_bpt::Work, this, std::ref(*shards[i]));
+      }
+    }
+
+    // the workers finish the jobs they were given before the trees close
+    ~sharded_bpt() {
+      for (int i = 0; i < N; ++i) {
+        {
+          std::lock_guard<std::mutex> lock(shards[i]->latch);
+          shards[i]->stop = true;
+        }
+        shards[i]->wake.notify_one();
+        shards[i]->worker.join();
+        delete shards[i];
+      }
+    }
+
+    sharded_bpt(const sharded_bpt &) = delete;
+    sharded_bpt &operator=(const sharded_bpt &) = delete;
+
+    // the tree of shard i, for its settings (EnableLog, SetCheckpoint, EnableFilter and so on)
+    tree &Shard(const int i) {
+      return shards[i]->data;
+    }
+
+    void Insert(const std::string &index, const Value &value) {
+      shards[ShardOf(index)]->data.Insert(index, value);
+    }
+
+    void Delete(const std::string &index, const Value &value) {
+      shards[ShardOf(index)]->data.Delete(index, value);
+    }
+
+    vector<Value> Find(const std::string &index) {
+      return shards[ShardOf(index)]->data.Find(index);
+    }
+
+    long long Count(const std::string &index) {
+      return shards[ShardOf(index)]->data.Count(index);
+    }
+
+    // Run every command of batch and return one result per command in the same order: the values for a FIND,
+    // nothing for the others. Each shard sees its commands in batch order, and commands on the same index
+    // always share a shard, so the outcome is that of running the batch one command after another.
+    // If a command throws, the rest of its shard's part is skipped and Execute throws once all parts are done.
+    vector<vector<Value>> Execute(std::span<const command> batch) {
+      vector<vector<Value>> results;
+      vector<int> commands[N];
+      for (size_t i = 0; i < batch.size(); ++i) {
+        results.push_back(vector<Value>());
+        commands[ShardOf(batch[i].index)].push_back(i);
+      }
+      int remaining = 0;
+      std::exception_ptr error;
+      for (int i = 0; i < N; ++i) {
+        if (!commands[i].empty()) {
+          ++remaining;
+        }
+      }
+      for (int i = 0; i < N; ++i) {
+        if (commands[i].empty()) {
+          continue;
+        }
+        {
+          std::lock_guard<std::mutex> lock(shards[i]->latch);
+          shards[i]->pending.push_back({batch, &commands[i], &results, &remaining, &error});
+        }
+        shards[i]->wake.notify_one();
+      }
+      std::unique_lock<std::mutex> lock(done_latch);
+      done.wait(lock, [&remaining] { return remaining == 0; });
+      if (error) {
+        std::rethrow_exception(error);
+      }
+      return results;
+    }
+
+    void Sync() {
+      for (int i = 0; i < N; ++i) {
+        shards[i]->data.Sync();
+      }
+    }
+
+    long long Size() {
+      long long size = 0;
+      for (int i = 0; i < N; ++i) {
+        size += shards[i]->data.Size();
+      }
+      return size;
+    }
+  };
+}
+
+#endif //SHARDED_BPT_H
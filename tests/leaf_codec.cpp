@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <cstdio>
+#include <limits>
+#include <random>
+#include <vector>
+#include "../index_key.h"
+#include "../leaf_codec.h"
+
+// Random leaves are encoded and must decode to the same entries, and Scan and Count must agree with them for
+// indexes that are present and absent. The values cover dense runs that become posting lists, sparse and
+// negative ones, and 64-bit values up to both ends of their range.
+template <typename Value>
+struct entry {
+  index_key<2> index;
+  Value value;
+
+  bool operator<(const entry &other) const {
+    return index != other.index ? index < other.index : value < other.value;
+  }
+
+  bool operator==(const entry &other) const {
+    return index == other.index && value == other.value;
+  }
+};
+
+enum kind { DENSE, SPARSE, NEGATIVE, EXTREME, KINDS };
+
+template <typename Value>
+Value Make(std::mt19937_64 &rng, const kind values, Value &last) {
+  using limits = std::numeric_limits<Value>;
+  switch (values) {
+    case DENSE:
+      return last += 1 + rng() % 4;
+    case SPARSE:
+      return static_cast<Value>(rng() % 1000000);
+    case NEGATIVE:
+      return limits::is_signed ? static_cast<Value>(static_cast<long long>(rng() % 2000) - 1000)
+                               : static_cast<Value>(rng());
+    default:
+      return rng() % 2 == 0 ? limits::max() - static_cast<Value>(rng() % 8) : limits::min() + static_cast<Value>(rng() % 8);
+  }
+}
+
+template <typename Value>
+bool Check(const char *name) {
+  using codec = leaf_codec<entry<Value>, Value>;
+  std::mt19937_64 rng(25);
+  std::vector<unsigned char> buffer(1 << 20);
+  long packed = 0; // leaves with a dense run that took under a byte per value
+  for (int round = 0; round < 2000; ++round) {
+    const kind values = static_cast<kind>(round % KINDS);
+    std::vector<entry<Value>> entries;
+    const int indexes = 1 + rng() % 16;
+    for (int i = 0; i < indexes; ++i) {
+      index_key<2> index;
+      index.word[0] = rng() % 40;
+      index.word[1] = rng() % 3;
+      const int count = rng() % 4 == 0 ? 200 + rng() % 2000 : 1 + rng() % 20;
+      Value last = static_cast<Value>(rng() % 100);
+      for (int j = 0; j < count; ++j) {
+        entries.push_back({index, Make<Value>(rng, values, last)});
+      }
+    }
+    std::sort(entries.begin(), entries.end());
+    entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+    const long n = entries.size();
+
+    const long bytes = codec::Encode(entries.data(), n, buffer.data());
+    typename codec::sizer sizer;
+    for (long i = 0; i < n; ++i) {
+      sizer.Add(entries[i]);
+    }
+    if (bytes != codec::Size(entries.data(), n) || bytes != sizer.Bytes()) {
+      std::printf("%s: the size of round %d is %ld, sizer says %ld\n", name, round, bytes, sizer.Bytes());
+      return false;
+    }
+    if (values == DENSE && bytes < n) {
+      ++packed;
+    }
+
+    std::vector<entry<Value>> decoded;
+    codec::Decode(buffer.data(), bytes, [&](const entry<Value> &item) { decoded.push_back(item); });
+    if (decoded != entries) {
+      std::printf("%s: round %d decodes to %zu of %ld entries\n", name, round, decoded.size(), n);
+      return false;
+    }
+
+    for (int query = 0; query < 8; ++query) {
+      index_key<2> index = entries[rng() % n].index;
+      if (query == 0) {
+        index.word[0] = 1000; // after every index
+      } else if (query == 1) {
+        index.word[1] = 7; // between two indexes
+      }
+      std::vector<Value> expected, scanned;
+      for (const entry<Value> &item : entries) {
+        if (item.index == index) {
+          expected.push_back(item.value);
+        }
+      }
+      const bool more = !(index < entries.back().index);
+      const bool scan_more = codec::Scan(buffer.data(), bytes, index, [&](const Value *found, const int count) {
+        scanned.insert(scanned.end(), found, found + count);
+      });
+      long long counted = 0;
+      const bool count_more = codec::Count(buffer.data(), bytes, index, counted);
+      if (scanned != expected || scan_more != more || counted != static_cast<long long>(expected.size()) ||
+          count_more != more) {
+        std::printf("%s: round %d finds %zu and counts %lld of %zu values\n", name, round, scanned.size(), counted,
+                    expected.size());
+        return false;
+      }
+    }
+  }
+  if (packed == 0) {
+    std::printf("%s: no dense run was stored as a posting list\n", name);
+    return false;
+  }
+  return true;
+}
+
+int main() {
+  bool good = Check<int>("int");
+  good = Check<long long>("long long") && good;
+  good = Check<unsigned long long>("unsigned long long") && good;
+  return good ? 0 : 1;
+}
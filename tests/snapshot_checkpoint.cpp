@@ -0,0 +1,64 @@
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include "../b_plus_tree.h"
+
+// Snapshots are scanned while a writer runs with the log on, so the page cache is flushed by checkpoints and
+// resized under the readers. Every index gets the values 0, 1, 2, ... in order, so a snapshot must see
+// each index holding 0 up to some value and nothing else, and exactly Size() values in all.
+constexpr int INDEXES = 64;
+constexpr int VALUES = 400;
+
+int main() {
+  const std::string map = "snapshot_checkpoint_map", data = "snapshot_checkpoint_data";
+  for (const std::string &name : {map, data, map + ".wal", map + ".ckpt", map + ".bloom"}) {
+    unlink(name.c_str());
+  }
+  std::atomic<bool> stop = false, bad = false;
+  long scans = 0;
+  {
+    sjtu::bpt<int, 1024> tree(map, data, 16);
+    tree.EnableLog(8);
+    tree.SetCheckpoint(200, 0);
+    std::thread reader([&] {
+      while (!stop && !bad) {
+        auto view = tree.Snapshot();
+        long long seen = 0;
+        for (int i = 0; i < INDEXES; ++i) {
+          const sjtu::vector<int> values = view.Find("k" + std::to_string(i));
+          for (size_t j = 0; j < values.size(); ++j) {
+            if (values[j] != static_cast<int>(j)) {
+              bad = true;
+            }
+          }
+          seen += values.size();
+        }
+        if (seen != view.Size()) {
+          bad = true;
+        }
+        ++scans;
+      }
+    });
+    for (int value = 0; value < VALUES && !bad; ++value) {
+      for (int i = 0; i < INDEXES; ++i) {
+        tree.Insert("k" + std::to_string(i), value);
+      }
+      if (value % 50 == 49) {
+        tree.SetCachePages(value % 100 == 49 ? 64 : 16);
+      }
+    }
+    stop = true;
+    reader.join();
+  }
+  for (const std::string &name : {map, data, map + ".wal", map + ".ckpt", map + ".bloom"}) {
+    unlink(name.c_str());
+  }
+  if (bad) {
+    std::puts("a snapshot changed while checkpoints ran");
+    return 1;
+  }
+  std::printf("%ld snapshot scans\n", scans);
+  return 0;
+}
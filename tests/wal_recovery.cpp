@@ -0,0 +1,114 @@
+#include <cstdio>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "../b_plus_tree.h"
+
+// A child process runs a fixed sequence of updates with the log on and ends with _exit, so nothing is written
+// back on the way out, as in a crash. Every update had been logged when it returned, so the reopened tree must
+// hold exactly what the same sequence gives in memory.
+using tree = sjtu::bpt<int, 1024>;
+using model = std::map<std::string, std::set<int>>;
+
+const std::string MAP = "wal_recovery_map", DATA = "wal_recovery_data";
+
+void Clean() {
+  for (const std::string &name : {MAP, DATA, MAP + ".wal", MAP + ".ckpt", MAP + ".bloom"}) {
+    unlink(name.c_str());
+  }
+}
+
+struct scenario {
+  const char *name;
+  bool compressed;
+  int updates;
+  int resize_every; // SetCachePages every so many updates, 0 never
+  int sync_every; // Sync every so many updates, 0 never
+  long checkpoint_ops; // automatic checkpoints, 0 never
+};
+
+// the updates of the scenario, applied to the tree if it is given and always to expected
+void Run(const scenario &run, tree *data, model &expected) {
+  std::mt19937 rng(17);
+  for (int i = 0; i < run.updates; ++i) {
+    const std::string index = "k" + std::to_string(rng() % 50);
+    const int value = rng() % 200;
+    if (rng() % 4 != 0) {
+      expected[index].insert(value);
+      if (data != nullptr) {
+        data->Insert(index, value);
+      }
+    } else {
+      expected[index].erase(value);
+      if (data != nullptr) {
+        data->Delete(index, value);
+      }
+    }
+    if (data != nullptr && run.sync_every > 0 && i % run.sync_every == run.sync_every - 1) {
+      data->Sync();
+    }
+    if (data != nullptr && run.resize_every > 0 && i % run.resize_every == run.resize_every - 1) {
+      data->SetCachePages(i / run.resize_every % 2 == 0 ? 128 : 64);
+    }
+  }
+}
+
+bool Check(const scenario &run) {
+  Clean();
+  const pid_t child = fork();
+  if (child == 0) {
+    tree data(MAP, DATA);
+    data.SetLeafCompression(run.compressed);
+    data.EnableLog(1);
+    data.SetCheckpoint(run.checkpoint_ops, 0);
+    model ignored;
+    Run(run, &data, ignored);
+    _exit(0);
+  }
+  int status = 0;
+  waitpid(child, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    std::printf("%s: the writer failed\n", run.name);
+    return false;
+  }
+  model expected;
+  Run(run, nullptr, expected);
+  bool good = true;
+  {
+    tree data(MAP, DATA);
+    long long size = 0;
+    for (const auto &[index, values] : expected) {
+      const sjtu::vector<int> found = data.Find(index);
+      good = good && found.size() == values.size();
+      size_t i = 0;
+      for (const int value : values) {
+        good = good && i < found.size() && found[i++] == value;
+      }
+      size += values.size();
+    }
+    good = good && data.Size() == size;
+  }
+  Clean();
+  if (!good) {
+    std::printf("%s: the recovered tree differs from the updates\n", run.name);
+  }
+  return good;
+}
+
+int main() {
+  const scenario runs[] = {
+      {"plain", false, 3000, 0, 500, 0},
+      {"resize", false, 3000, 250, 700, 0},
+      {"resize before any sync", false, 600, 100, 0, 0},
+      {"auto checkpoints", false, 3000, 300, 0, 400},
+      {"compressed", true, 3000, 250, 900, 500},
+  };
+  bool good = true;
+  for (const scenario &run : runs) {
+    good = Check(run) && good;
+  }
+  return good ? 0 : 1;
+}
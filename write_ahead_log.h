@@ -0,0 +1,289 @@
+#ifndef WRITE_AHEAD_LOG_H
+#define WRITE_AHEAD_LOG_H
+
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "exceptions.hpp"
+
+constexpr unsigned long long LOG_MAGIC = 0x6270742d6c6f6721ull;
+
+inline unsigned long long Checksum(const char *data, const long length) {
+  unsigned long long hash = 1469598103934665603ull; // FNV-1a
+  for (long i = 0; i < length; ++i) {
+    hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+  }
+  return hash;
+}
+
+inline bool ReadFully(const int fd, void *target, const long length) {
+  char *p = static_cast<char *>(target);
+  long done = 0;
+  while (done < length) {
+    const long got = read(fd, p + done, length - done);
+    if (got <= 0) {
+      return false;
+    }
+    done += got;
+  }
+  return true;
+}
+
+inline void WriteFully(const int fd, const void *source, const long length) {
+  const char *p = static_cast<const char *>(source);
+  long done = 0;
+  while (done < length) {
+    const long put = write(fd, p + done, length - done);
+    if (put <= 0) {
+      throw sjtu::runtime_error();
+    }
+    done += put;
+  }
+}
+
+// Append-only redo log. Records are buffered and written with one fdatasync per group of group_size,
+// so a crash loses at most the records of the group that was still open.
+template <typename Record>
+class write_ahead_log {
+
+  struct group_header {
+    unsigned long long magic = LOG_MAGIC;
+    long count = 0;
+    unsigned long long checksum = 0;
+  };
+
+  std::string file_name;
+  int fd = -1;
+  char *buffer = nullptr; // group_header followed by the pending records
+  long group_size = 0, pending = 0;
+
+  Record *Pending() const {
+    return reinterpret_cast<Record *>(buffer + sizeof(group_header));
+  }
+
+public:
+  explicit write_ahead_log(const std::string &file_name) : file_name(file_name) {
+    fd = open(file_name.c_str(), O_RDWR); // only created once logging is turned on
+  }
+
+  ~write_ahead_log() {
+    if (buffer != nullptr) {
+      Commit();
+      delete[] buffer;
+    }
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+
+  write_ahead_log(const write_ahead_log &) = delete;
+  write_ahead_log &operator=(const write_ahead_log &) = delete;
+
+  void Enable(const long records_per_group) {
+    if (fd == -1) {
+      fd = open(file_name.c_str(), O_RDWR | O_CREAT, 0644);
+      if (fd == -1) {
+        throw sjtu::runtime_error();
+      }
+    }
+    if (buffer != nullptr) {
+      Commit();
+      delete[] buffer;
+    }
+    group_size = records_per_group < 1 ? 1 : records_per_group;
+    buffer = new char[sizeof(group_header) + group_size * sizeof(Record)];
+    pending = 0;
+  }
+
+  bool Enabled() const {
+    return buffer != nullptr;
+  }
+
+  bool Empty() const {
+    struct stat info{};
+    return fd == -1 || fstat(fd, &info) != 0 || info.st_size == 0;
+  }
+
+  void Append(const Record &record) {
+    std::memcpy(static_cast<void *>(Pending() + pending), &record, sizeof(Record));
+    if (++pending == group_size) {
+      Commit();
+    }
+  }
+
+  // make every appended record durable
+  void Commit() {
+    if (pending == 0) {
+      return;
+    }
+    group_header header;
+    header.count = pending;
+    header.checksum = Checksum(buffer + sizeof(group_header), pending * sizeof(Record));
+    std::memcpy(buffer, &header, sizeof(header));
+    lseek(fd, 0, SEEK_END);
+    WriteFully(fd, buffer, sizeof(group_header) + pending * sizeof(Record));
+    fdatasync(fd);
+    pending = 0;
+  }
+
+  // hand every record of every complete group to apply, in order; a torn last group is ignored
+  template <typename Apply>
+  void Replay(Apply &&apply) {
+    if (fd == -1) {
+      return;
+    }
+    lseek(fd, 0, SEEK_SET);
+    group_header header;
+    char *records = nullptr;
+    long records_capacity = 0;
+    while (ReadFully(fd, &header, sizeof(header)) && header.magic == LOG_MAGIC && header.count > 0) {
+      if (header.count > records_capacity) {
+        delete[] records;
+        records_capacity = header.count;
+        records = new char[records_capacity * sizeof(Record)];
+      }
+      if (!ReadFully(fd, records, header.count * sizeof(Record)) ||
+          Checksum(records, header.count * sizeof(Record)) != header.checksum) {
+        break;
+      }
+      for (long i = 0; i < header.count; ++i) {
+        Record record;
+        std::memcpy(static_cast<void *>(&record), records + i * sizeof(Record), sizeof(Record));
+        apply(record);
+      }
+    }
+    delete[] records;
+  }
+
+  // drop every record, called once a checkpoint covers all of them
+  void Reset() {
+    if (fd == -1) {
+      return;
+    }
+    pending = 0;
+    if (ftruncate(fd, 0) != 0) {
+      throw sjtu::runtime_error();
+    }
+    fsync(fd);
+  }
+};
+
+// Double-write area for checkpoints. The dirty pages and the header information are made durable here
+// before they overwrite their home locations, so a crash during a checkpoint never leaves a torn tree.
+template <typename Block, typename Info>
+class checkpoint_image {
+
+  struct trailer {
+    unsigned long long magic = LOG_MAGIC;
+    long count = 0;
+    unsigned long long checksum = 0;
+    Info info;
+  };
+
+  std::string file_name;
+  int fd = -1;
+  long count = 0;
+  unsigned long long checksum = 0;
+
+  struct page {
+    long index;
+    Block block;
+  };
+
+public:
+  explicit checkpoint_image(const std::string &file_name) : file_name(file_name) {
+    fd = open(file_name.c_str(), O_RDWR);
+  }
+
+  ~checkpoint_image() {
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+
+  checkpoint_image(const checkpoint_image &) = delete;
+  checkpoint_image &operator=(const checkpoint_image &) = delete;
+
+  void Begin() {
+    if (fd == -1) {
+      fd = open(file_name.c_str(), O_RDWR | O_CREAT, 0644);
+      if (fd == -1) {
+        throw sjtu::runtime_error();
+      }
+    }
+    if (ftruncate(fd, 0) != 0) {
+      throw sjtu::runtime_error();
+    }
+    lseek(fd, 0, SEEK_SET);
+    count = 0;
+    checksum = 0;
+  }
+
+  void Add(const long index, const Block &block) {
+    page target;
+    target.index = index;
+    target.block = block;
+    WriteFully(fd, &target, sizeof(target));
+    checksum = checksum * 1099511628211ull + Checksum(reinterpret_cast<char *>(&target), sizeof(target));
+    ++count;
+  }
+
+  // the image is valid from the moment this returns
+  void Commit(const Info &info) {
+    trailer end;
+    end.count = count;
+    end.checksum = checksum;
+    end.info = info;
+    WriteFully(fd, &end, sizeof(end));
+    fdatasync(fd);
+  }
+
+  // if a complete image exists, hand its pages to apply, store its information and return true
+  template <typename Apply>
+  bool Restore(Info &info, Apply &&apply) {
+    if (fd == -1) {
+      return false;
+    }
+    const long end = lseek(fd, 0, SEEK_END);
+    if (end < static_cast<long>(sizeof(trailer))) {
+      return false;
+    }
+    trailer last;
+    lseek(fd, end - sizeof(trailer), SEEK_SET);
+    if (!ReadFully(fd, &last, sizeof(last)) || last.magic != LOG_MAGIC ||
+        last.count * static_cast<long>(sizeof(page)) + static_cast<long>(sizeof(trailer)) != end) {
+      return false;
+    }
+    unsigned long long sum = 0;
+    page target;
+    lseek(fd, 0, SEEK_SET);
+    for (long i = 0; i < last.count; ++i) {
+      ReadFully(fd, &target, sizeof(target));
+      sum = sum * 1099511628211ull + Checksum(reinterpret_cast<char *>(&target), sizeof(target));
+    }
+    if (sum != last.checksum) {
+      return false;
+    }
+    lseek(fd, 0, SEEK_SET);
+    for (long i = 0; i < last.count; ++i) {
+      ReadFully(fd, &target, sizeof(target));
+      apply(target.index, target.block);
+    }
+    info = last.info;
+    return true;
+  }
+
+  void Reset() {
+    if (fd == -1) {
+      return;
+    }
+    if (ftruncate(fd, 0) != 0) {
+      throw sjtu::runtime_error();
+    }
+    fsync(fd);
+  }
+};
+
+#endif //WRITE_AHEAD_LOG_H